@@ -2,6 +2,8 @@
 // g++ -std=c++11 add_test_ochell.cpp -o add_test_ochell -l pocl && ./add_test_ochell
 // or
 // g++ -std=c++11 add_test_ochell.cpp -o add_test_ochell -l OpenCL && ./add_test_ochell
+// or, with the kernels embedded in the executable
+// ./embed_kernels.py *.cl > ochell_kernels.hh && g++ -std=c++11 -D OCHELL_EMBED_KERNELS add_test_ochell.cpp -o add_test_ochell -l OpenCL
 
 #include <iostream>
 #include <cstdlib>
@@ -10,54 +12,63 @@
 
 int main(int argc, char **argv) {
 	int len = 100;
-	int *A = new int[len];
-	int *B = new int[len];
-	int *C = new int[len];
-	
-	for (int i = 0; i < len; ++i) {
-		A[i] = 10 + i;
-		B[i] = 100 + i;
-	}
+	size_t bsize = len * sizeof(int);
 
 	// Create a context using the first device available
 	cl::Context context = create_context(CL_DEVICE_TYPE_CPU);
 
-	// Alocate buffers for I/O
-	cl::Buffer inA = create_buffer(context, "rh", len, A);
-	cl::Buffer inB = create_buffer(context, "rh", len, B);
-	cl::Buffer outC = create_buffer(context, "wh", len, C);
-
 	// Get a device handler
 	std::vector<cl::Device> devices = get_devices(context);
 	std::cout << "INFO: " << devices.size() << " devices available\n";
-	
+
+	// Create a Command Queue for the device (1-to-1)
+	cl::CommandQueue queue = create_command_queue(context, devices[0]);
+
+	// Alocate buffers for I/O in host accessible memory, so that on CPU
+	// devices mapping them does not copy data around
+	cl::Buffer inA = create_buffer(context, OCH_MEM_FLAGS("ra"), bsize);
+	cl::Buffer inB = create_buffer(context, OCH_MEM_FLAGS("ra"), bsize);
+	cl::Buffer outC = create_buffer(context, OCH_MEM_FLAGS("wa"), bsize);
+
+	// Fill the inputs in place
+	int *A = (int *)map_buffer(queue, inA, "w", 0, bsize);
+	int *B = (int *)map_buffer(queue, inB, "w", 0, bsize);
+	for (int i = 0; i < len; ++i) {
+		A[i] = 10 + i;
+		B[i] = 100 + i;
+	}
+	std::vector<cl::Event> unmaps;
+	unmaps.push_back(unmap_buffer(queue, inA, A));
+	unmaps.push_back(unmap_buffer(queue, inB, B));
+
 	// Create the program
 	cl::Program program = load_and_build_program(
 		context, devices, "vector_add_kernel.cl"
 	);
 
-	// Create a kernel object for accessing kernel entry point
-	cl::Kernel ker_vec_add = load_kernel(program, "vector_add");
+	// Create a kernel object for accessing kernel entry point, using the
+	// vector width preferred by the device
+	size_t width = vector_add_width(devices[0]);
+	cl::Kernel ker_vec_add = load_kernel(program, vector_add_kernel_name(width));
 
 	// Set the arguments for this kernel (variadic template)
 	set_kernel_args(ker_vec_add, inA, inB, outC, len);
 
-	// Create a Command Queue for the device (1-to-1)
-	cl::CommandQueue queue = create_command_queue(context, devices[0]);
+	// Enqueue the kernel and get an event to check results. The local size
+	// is tuned on the first run, and taken from the tuning database later
+	tuning_database().auto_tune = true;
+	std::vector<cl::Event> launch(1, enqueue_nd_range_kernel(
+		queue, ker_vec_add, cl::NullRange, vector_add_global(width, len),
+		cl::NullRange, unmaps
+	));
 
-	// Enqueue the kernel and get an event to check results
-	cl::Event event = enqueue_nd_range_kernel(
-		queue, ker_vec_add, cl::NullRange, cl::NDRange(len), cl::NDRange(1, 1)
-	);
-	
-	// Wait for the conclusion
-	event.wait();
-	blocking_read_buffer(queue, outC, 0, len, C);
-	
+	// Map the output for reading, after the kernel is done
+	int *C = (int *)map_buffer(queue, outC, "r", 0, bsize, launch);
 	for (int i = 0; i < len; ++i)
 		std::cout << C[i] << " ";
 	std::cout << std::endl;
+	unmap_buffer(queue, outC, C).wait();
+	print_program_cache_stats(std::cout);
 
 	exit(EXIT_SUCCESS);
 }
-
@@ -0,0 +1,38 @@
+// Stream compaction: copy the elements satisfying a predicate to the start of
+// the output, in order. compact_flags marks the survivors, the marks are
+// scanned (see scan.cl) into their output positions, and compact_scatter
+// moves them there and writes their count. Build defines:
+//  T                  element type (int)
+//  PREDICATE(x, arg)  whether x survives, given the kernel argument arg
+//                     (x > arg)
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef T
+#define T int
+#endif
+#ifndef PREDICATE
+#define PREDICATE(x, arg) ((x) > (arg))
+#endif
+
+// flags[i] = 1 if in[i] survives, 0 otherwise
+__kernel void compact_flags(__global const T *in, __global uint *flags, const ulong n, const T arg) {
+	size_t i = get_global_id(0);
+	if (i < n)
+		flags[i] = PREDICATE(in[i], arg) ? 1 : 0;
+}
+
+// Move the survivors to out at the positions given by the exclusive scan of
+// the flags, and write their number in count[0]
+__kernel void compact_scatter(__global const T *in, __global const uint *positions, __global T *out, __global uint *count, const ulong n, const T arg) {
+	size_t i = get_global_id(0);
+	if (i >= n)
+		return;
+	bool survives = PREDICATE(in[i], arg);
+	if (survives)
+		out[positions[i]] = in[i];
+	if (i == n - 1)
+		count[0] = positions[i] + (survives ? 1 : 0);
+}
@@ -0,0 +1,70 @@
+// Compiled with
+// g++ -std=c++11 -O2 compact_ochell.cpp -o compact_ochell -l OpenCL && ./compact_ochell
+// Usage: ./compact_ochell [length (16777216)] [threshold (1800000)]
+// Runs vector_add, then keeps the elements of C above the threshold: reading
+// back the whole C and filtering on the host, or compacting on the device and
+// reading back the survivors only
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+
+#include "ochell.hh"
+
+typedef std::chrono::steady_clock Clock;
+
+double ms_since(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count() * 1e3;
+}
+
+int main(int argc, char **argv) {
+	size_t len = argc > 1 ? std::atol(argv[1]) : 1 << 24;
+	cl_int threshold = argc > 2 ? std::atoi(argv[2]) : 1800000;
+	size_t bsize = len * sizeof(cl_int);
+
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+	env.load_program("vector_add_kernel.cl");
+	cl::CommandQueue &queue = env.queue();
+	std::vector<cl_int> A(len), B(len);
+	for (size_t i = 0; i < len; ++i) {
+		A[i] = std::rand() % 1000000;
+		B[i] = std::rand() % 1000000;
+	}
+	DeviceVector<cl_int> dA(env.context, len), dB(env.context, len);
+	DeviceVector<cl_int> dC(env.context, len), kept(env.context, len);
+	dA.copy_from(queue, &A[0]);
+	dB.copy_from(queue, &B[0]);
+	set_kernel_args(env.kernel("vector_add"), dA, dB, dC, (cl_int)len);
+	enqueue_nd_range_kernel(queue, env.kernel("vector_add"), cl::NullRange,
+		cl::NDRange(len), cl::NullRange);
+	queue.finish();
+
+	// Whole C back, filtered on the host
+	Clock::time_point start = Clock::now();
+	std::vector<cl_int> C(len), expected;
+	dC.copy_to(queue, &C[0]).wait();
+	for (size_t i = 0; i < len; ++i)
+		if (C[i] > threshold)
+			expected.push_back(C[i]);
+	double host_ms = ms_since(start);
+
+	// Once to build the kernels
+	compact(env, dC, kept, "(x)>arg", threshold);
+	start = Clock::now();
+	std::vector<cl_int> survivors(compact(env, dC, kept, "(x)>arg",
+		threshold));
+	if (!survivors.empty())
+		kept.copy_to(queue, &survivors[0], survivors.size()).wait();
+	double device_ms = ms_since(start);
+
+	std::cout << "selectivity " << (double)survivors.size() / len << std::endl;
+	std::cout << "host filter: " << host_ms << " ms, " << bsize
+		<< " bytes read back" << std::endl;
+	std::cout << "compaction: " << device_ms << " ms, "
+		<< survivors.size() * sizeof(cl_int) + sizeof(cl_uint)
+		<< " bytes read back" << std::endl;
+	std::cout << "check: " << (survivors == expected ? "ok" : "FAILED")
+		<< std::endl;
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,78 @@
+// Compiled with
+// g++ -std=c++11 -O2 -march=native dispatch_ochell.cpp -o dispatch_ochell -l OpenCL -pthread && ./dispatch_ochell
+// Times vector_add and square_matrix_multiply on host arrays of growing size,
+// forced on the native backend and on OpenCL, and as routed by the dispatcher
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <limits>
+
+#include "ochell.hh"
+
+typedef std::chrono::steady_clock Clock;
+
+// Milliseconds taken by f, best of a few runs
+template <class F>
+double best_ms(F f) {
+	double best = -1;
+	for (int r = 0; r < 5; ++r) {
+		Clock::time_point start = Clock::now();
+		f();
+		double t = std::chrono::duration<double>(Clock::now() - start).count();
+		if (best < 0 || t < best)
+			best = t;
+	}
+	return best * 1e3;
+}
+
+int main() {
+	OCHDispatcher dispatch;
+	std::cout << "native backend: " << native_isa() << ", " <<
+		native_thread_pool().size() << " threads, OpenCL "
+		<< (dispatch.has_opencl() ? "available" : "not available") << std::endl;
+	size_t defaults[2] = { dispatch.vector_add_threshold,
+		dispatch.matrix_threshold };
+	const size_t never = std::numeric_limits<size_t>::max();
+
+	size_t lens[] = { 100, 1 << 16, 1 << 20, 1 << 24 };
+	for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); ++l) {
+		size_t len = lens[l];
+		std::vector<cl_int> A(len, 1), B(len, 2), C(len);
+		std::cout << "vector_add " << len << ":";
+		for (int mode = 0; mode < 3; ++mode) {
+			if (mode == 1 && !dispatch.has_opencl())
+				continue;
+			dispatch.vector_add_threshold = mode == 0 ? never :
+				mode == 1 ? 0 : defaults[0];
+			double ms = best_ms([&] {
+				dispatch.vector_add(&A[0], &B[0], &C[0], len);
+			});
+			std::cout << (mode == 0 ? " native " : mode == 1 ? ", opencl " :
+				", dispatched ") << ms << " ms";
+		}
+		std::cout << (C[len - 1] == 3 ? "" : " FAILED") << std::endl;
+	}
+
+	size_t sides[] = { 16, 128, 512 };
+	for (size_t s = 0; s < sizeof(sides) / sizeof(sides[0]); ++s) {
+		size_t side = sides[s];
+		std::vector<cl_int> A(side * side, 1), B(side * side, 2);
+		std::vector<cl_int> C(side * side);
+		std::cout << "square_matrix_multiply " << side << ":";
+		for (int mode = 0; mode < 3; ++mode) {
+			if (mode == 1 && !dispatch.has_opencl())
+				continue;
+			dispatch.matrix_threshold = mode == 0 ? never :
+				mode == 1 ? 0 : defaults[1];
+			double ms = best_ms([&] {
+				dispatch.square_matrix_multiply(&C[0], &A[0], &B[0], side);
+			});
+			std::cout << (mode == 0 ? " native " : mode == 1 ? ", opencl " :
+				", dispatched ") << ms << " ms";
+		}
+		std::cout << (C[0] == (cl_int)(2 * side) ? "" : " FAILED") << std::endl;
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+
+'''Embed OpenCL sources in a C++ header, so that programs using OCHell do not
+need the .cl files at runtime. The header is included by ochell.hh when
+OCHELL_EMBED_KERNELS is defined, and load_and_build_program takes the
+embedded sources in place of files with the same name.
+
+Example usage:
+
+	./embed_kernels.py *.cl > ochell_kernels.hh
+	g++ -std=c++11 -D OCHELL_EMBED_KERNELS add_test_ochell.cpp -o add_test_ochell -l OpenCL
+'''
+
+import os
+import re
+import sys
+
+def array_name(path):
+	'''C identifier of the array holding the file at path'''
+	return 'ochell_source_' + re.sub(r'\W', '_', os.path.basename(path))
+
+def embed(paths, out):
+	out.write('// Generated by embed_kernels.py, do not edit\n\n')
+	out.write('#ifndef __OCHELL_KERNELS_H__\n#define __OCHELL_KERNELS_H__\n\n')
+	for path in paths:
+		with open(path, 'rb') as f:
+			data = f.read() + b'\0'
+		out.write('constexpr char %s[] = {\n' % array_name(path))
+		for i in range(0, len(data), 12):
+			row = ', '.join('0x%02x' % b for b in data[i:i + 12])
+			out.write('\t%s,\n' % row)
+		out.write('};\n\n')
+
+	out.write('const OCHEmbeddedSource ochell_embedded_sources[] = {\n')
+	for path in paths:
+		name = array_name(path)
+		out.write('\t{"%s", %s, sizeof(%s) - 1},\n'
+			% (os.path.basename(path), name, name))
+	out.write('};\n\n')
+	out.write('const bool ochell_embedded_sources_registered =\n')
+	out.write('\tregister_embedded_sources(ochell_embedded_sources, %d);\n\n'
+		% len(paths))
+	out.write('#endif /* __OCHELL_KERNELS_H__ */\n')
+
+if __name__ == '__main__':
+	if len(sys.argv) < 2:
+		sys.exit('Usage: %s file.cl... > ochell_kernels.hh' % sys.argv[0])
+	embed(sys.argv[1:], sys.stdout)
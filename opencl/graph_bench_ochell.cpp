@@ -0,0 +1,116 @@
+// Compiled with
+// g++ -std=c++11 -O2 graph_bench_ochell.cpp -o graph_bench_ochell -l OpenCL && ./graph_bench_ochell
+// Usage: ./graph_bench_ochell [iterations (10000)] [length (1024)]
+// Host submission time of the upload, vector_add, download sequence, issued
+// command by command with the helpers, with a typed kernel, or replayed from a
+// command graph
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+
+#include "ochell.hh"
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds(Clock::time_point start, Clock::time_point end) {
+	return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char **argv) {
+	int iterations = argc > 1 ? std::atoi(argv[1]) : 10000;
+	int len = argc > 2 ? std::atoi(argv[2]) : 1024;
+	size_t bsize = len * sizeof(int);
+
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+	env.load_program("vector_add_kernel.cl");
+	cl::CommandQueue &queue = env.queue(0);
+	cl::Buffer inA = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+	cl::Buffer inB = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+	cl::Buffer outC = create_buffer(env.context, OCH_MEM_FLAGS("w"), bsize);
+	std::vector<int> A(len), B(len), C(len);
+
+	// Command by command
+	cl::Kernel &kern = env.kernel("vector_add");
+	double submit = 0;
+	Clock::time_point start = Clock::now();
+	for (int it = 0; it < iterations; ++it) {
+		A[0] = B[0] = it;
+		Clock::time_point t = Clock::now();
+		set_kernel_args(kern, inA, inB, outC, len);
+		std::vector<cl::Event> uploads;
+		uploads.push_back(enqueue_write_buffer(queue, inA, 0, bsize, &A[0]));
+		uploads.push_back(enqueue_write_buffer(queue, inB, 0, bsize, &B[0]));
+		std::vector<cl::Event> launch(1, enqueue_nd_range_kernel(queue, kern,
+			cl::NullRange, cl::NDRange(len), cl::NullRange, uploads));
+		cl::Event done = enqueue_read_buffer(queue, outC, 0, bsize, &C[0],
+			launch);
+		submit += seconds(t, Clock::now());
+		done.wait();
+	}
+	double total = seconds(start, Clock::now());
+	std::cout << "helpers: " << submit / iterations * 1e6 << " us submission, "
+		<< total / iterations * 1e6 << " us total per iteration" << std::endl;
+
+	// Typed kernel, arguments are set only on the first launch
+	OCHKernel<cl::Buffer, cl::Buffer, cl::Buffer, int> vadd =
+		make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, int>(
+			env.programs[0], "vector_add");
+	submit = 0;
+	start = Clock::now();
+	for (int it = 0; it < iterations; ++it) {
+		A[0] = B[0] = it;
+		Clock::time_point t = Clock::now();
+		std::vector<cl::Event> uploads;
+		uploads.push_back(enqueue_write_buffer(queue, inA, 0, bsize, &A[0]));
+		uploads.push_back(enqueue_write_buffer(queue, inB, 0, bsize, &B[0]));
+		std::vector<cl::Event> launch(1, vadd.launch(queue, cl::NDRange(len),
+			cl::NullRange, uploads, inA, inB, outC, len));
+		cl::Event done = enqueue_read_buffer(queue, outC, 0, bsize, &C[0],
+			launch);
+		submit += seconds(t, Clock::now());
+		done.wait();
+	}
+	total = seconds(start, Clock::now());
+	std::cout << "typed:   " << submit / iterations * 1e6 << " us submission, "
+		<< total / iterations * 1e6 << " us total per iteration" << std::endl;
+
+	// Recorded once, replayed
+	cl::Kernel graph_kern = env.new_kernel("vector_add");
+	set_kernel_args(graph_kern, inA, inB, outC, len);
+	OCHCommandGraph graph(queue);
+	size_t a = graph.buffer_slot(), b = graph.buffer_slot();
+	size_t c = graph.buffer_slot();
+	size_t ha = graph.host_slot(), hb = graph.host_slot();
+	size_t hc = graph.host_slot();
+	graph.write(a, ha, 0, bsize);
+	graph.write(b, hb, 0, bsize);
+	size_t node = graph.launch(graph_kern, cl::NDRange(len));
+	graph.arg(node, 0, a);
+	graph.arg(node, 1, b);
+	graph.arg(node, 2, c);
+	graph.read(c, hc, 0, bsize);
+	graph.bind_buffer(a, inA);
+	graph.bind_buffer(b, inB);
+	graph.bind_buffer(c, outC);
+
+	submit = 0;
+	start = Clock::now();
+	for (int it = 0; it < iterations; ++it) {
+		A[0] = B[0] = it;
+		Clock::time_point t = Clock::now();
+		graph.bind_host(ha, &A[0]);
+		graph.bind_host(hb, &B[0]);
+		graph.bind_host(hc, &C[0]);
+		cl::Event done = graph.replay();
+		submit += seconds(t, Clock::now());
+		done.wait();
+	}
+	total = seconds(start, Clock::now());
+	std::cout << "graph:   " << submit / iterations * 1e6 << " us submission, "
+		<< total / iterations * 1e6 << " us total per iteration" << std::endl;
+	std::cout << "check:   " << (C[0] == 2 * (iterations - 1) ? "ok" : "FAILED")
+		<< std::endl;
+
+	exit(EXIT_SUCCESS);
+}
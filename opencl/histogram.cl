@@ -0,0 +1,87 @@
+// Histograms of arrays over NUM_BINS equal ranges of [lo, hi). Values outside
+// are not counted. Each work-group counts into its own bins in local memory,
+// then adds them to the global bins, so hot bins are contended only within a
+// group. Bins are exact for integer types, and computed in double for
+// floating ones when the device supports it. Build defines:
+//  T         element type (int)
+//  INTEGRAL  1 if T is an integer type (1)
+//  NUM_BINS  number of bins, all fitting in local memory (256)
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef T
+#define T int
+#endif
+#ifndef INTEGRAL
+#define INTEGRAL 1
+#endif
+#ifndef NUM_BINS
+#define NUM_BINS 256
+#endif
+
+#if INTEGRAL
+// floor(d * NUM_BINS / range) for d < range, without overflow: in 64 bits if
+// the product fits, else searching the largest bin k with k * range <= d *
+// NUM_BINS, comparing 128-bit products
+uint bin_of(ulong d, ulong range) {
+	ulong high = mul_hi(d, (ulong)NUM_BINS);
+	ulong low = d * NUM_BINS;
+	if (high == 0)
+		return (uint)(low / range);
+	uint k = 0;
+	for (uint step = 1u << 31; step > 0; step >>= 1) {
+		ulong c = k + step;
+		if (c >= NUM_BINS)
+			continue;
+		ulong c_high = mul_hi(c, range);
+		if (c_high < high || (c_high == high && c * range <= low))
+			k = c;
+	}
+	return k;
+}
+
+// Bin of x in [lo, hi). Differences are taken modulo 2^64, so they are right
+// for signed types too
+#define BIN(x, lo, hi) bin_of((ulong)(x) - (ulong)(lo), (ulong)(hi) - (ulong)(lo))
+#else
+#ifdef cl_khr_fp64
+typedef double real;
+#else
+typedef float real;
+#endif
+// Bin of x in [lo, hi). Rounding can not go past the last bin
+#define BIN(x, lo, hi) min((uint)(((real)(x) - (real)(lo)) * NUM_BINS / \
+	((real)(hi) - (real)(lo))), (uint)(NUM_BINS - 1))
+#endif
+
+// Add the counts of the n elements of in to bins, which must start at zero.
+// Work-items stride over the input, so any number of groups can be used
+__kernel void histogram(__global const T *in, __global uint *bins, const ulong n, const T lo, const T hi) {
+	__local uint local_bins[NUM_BINS];
+	for (size_t b = get_local_id(0); b < NUM_BINS; b += get_local_size(0))
+		local_bins[b] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) {
+		T x = in[i];
+		if (x >= lo && x < hi)
+			atomic_inc(&local_bins[BIN(x, lo, hi)]);
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (size_t b = get_local_id(0); b < NUM_BINS; b += get_local_size(0))
+		if (local_bins[b] > 0)
+			atomic_add(&bins[b], local_bins[b]);
+}
+
+// Same as histogram, incrementing the global bins directly. Slower when many
+// values fall in the same bins; kept for comparison
+__kernel void histogram_global(__global const T *in, __global uint *bins, const ulong n, const T lo, const T hi) {
+	for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) {
+		T x = in[i];
+		if (x >= lo && x < hi)
+			atomic_inc(&bins[BIN(x, lo, hi)]);
+	}
+}
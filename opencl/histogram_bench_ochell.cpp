@@ -0,0 +1,110 @@
+// Compiled with
+// g++ -std=c++11 -O2 histogram_bench_ochell.cpp -o histogram_bench_ochell -l OpenCL && ./histogram_bench_ochell
+// Usage: ./histogram_bench_ochell [length (16777216)] [bins (256)]
+// Histogram of uniform, skewed (most values in a few bins) and bin edge int
+// inputs, with bins privatized in local memory and with global atomics only. Both
+// kernels run with the same sizes, and are timed by their profiling events
+
+#include <iostream>
+#include <cstdlib>
+#include <limits>
+#include <random>
+
+#include "ochell.hh"
+
+// Run a kernel of histogram.cl on in, into counts, and get its time in ms
+double run(OCHEnvironment &env, cl::Kernel &kernel, DeviceVector<cl_int> &in,
+	size_t bins, cl_int hi, const cl::NDRange &global,
+	const cl::NDRange &local, std::vector<cl_uint> &counts)
+{
+	counts.assign(bins, 0);
+	cl::Buffer counts_buffer = create_buffer(env.context,
+		OCH_MEM_FLAGS("rwc"), bins * sizeof(cl_uint), &counts[0]);
+	set_kernel_args(kernel, in, counts_buffer, (cl_ulong)in.size(), (cl_int)0,
+		hi);
+	cl::Event event = enqueue_nd_range_kernel(env.queue(), kernel,
+		cl::NullRange, global, local);
+	blocking_read_buffer(env.queue(), counts_buffer, 0,
+		bins * sizeof(cl_uint), &counts[0]);
+	return 1e-6 * (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+		event.getProfilingInfo<CL_PROFILING_COMMAND_START>());
+}
+
+// Histogram of host values in [0, hi)
+void bench(OCHEnvironment &env, const char *name,
+	const std::vector<cl_int> &host, size_t bins, cl_int hi)
+{
+	size_t len = host.size();
+	DeviceVector<cl_int> in(env.context, len);
+	in.copy_from(env.queue(), &host[0]).wait();
+	std::vector<cl_uint> expected(bins, 0);
+	for (size_t i = 0; i < len; ++i)
+		expected[(cl_ulong)host[i] * bins / hi]++;
+
+	// The helper, for correctness
+	std::vector<cl_uint> counts = histogram(env, in, bins, 0, hi);
+
+	std::string options = "-D T=int -D INTEGRAL=1 -D NUM_BINS=" +
+		std::to_string(bins);
+	cl::Kernel &privatized = env.kernel("histogram", "histogram.cl", options);
+	cl::Kernel &naive = env.kernel("histogram_global", "histogram.cl",
+		options);
+	// A few groups per compute unit, as the helper
+	cl::Device &device = env.devices[0];
+	size_t wg = 256;
+	while (wg > std::min(
+		privatized.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device),
+		naive.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)))
+		wg /= 2;
+	cl::NDRange global(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4 * wg),
+		local(wg);
+
+	std::vector<cl_uint> local_counts, global_counts;
+	double local_ms = run(env, privatized, in, bins, hi, global, local,
+		local_counts);
+	double global_ms = run(env, naive, in, bins, hi, global, local,
+		global_counts);
+
+	std::cout << name << ": local bins " << local_ms << " ms, global atomics "
+		<< global_ms << " ms, " << (counts == expected &&
+		local_counts == expected && global_counts == expected ?
+		"ok" : "FAILED") << std::endl;
+}
+
+int main(int argc, char **argv) {
+	size_t len = argc > 1 ? std::atol(argv[1]) : 1 << 24;
+	size_t bins = argc > 2 ? std::atol(argv[2]) : 256;
+	// Bins of width 1000 for the random inputs
+	if (bins == 0 ||
+		bins > (size_t)std::numeric_limits<cl_int>::max() / 1000)
+	{
+		std::cerr << "ERROR: bins must be in [1, "
+			<< std::numeric_limits<cl_int>::max() / 1000 << "]\n";
+		exit(EXIT_FAILURE);
+	}
+	cl_int range = (cl_int)(bins * 1000);
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL, CL_QUEUE_PROFILING_ENABLE);
+
+	std::mt19937 rng(7);
+	std::vector<cl_int> uniform(len), skewed(len), edges(len);
+	std::uniform_int_distribution<cl_int> any_value(0, range - 1);
+	std::geometric_distribution<cl_int> few_bins(0.5);
+	for (size_t i = 0; i < len; ++i) {
+		uniform[i] = any_value(rng);
+		skewed[i] = std::min(few_bins(rng) * 1000 + any_value(rng) % 1000,
+			range - 1);
+	}
+	// The first value of each bin of [0, 2^30) and the one before it, where
+	// rounding in float would pick the wrong bin
+	const cl_int wide = 1 << 30;
+	for (size_t i = 0; i < len; ++i) {
+		cl_ulong k = (i / 2) % bins;
+		cl_int first = (cl_int)((k * wide + bins - 1) / bins);
+		edges[i] = i % 2 == 0 || first == 0 ? first : first - 1;
+	}
+	bench(env, "uniform", uniform, bins, range);
+	bench(env, "skewed", skewed, bins, range);
+	bench(env, "edges", edges, bins, wide);
+
+	exit(EXIT_SUCCESS);
+}
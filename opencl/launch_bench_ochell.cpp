@@ -0,0 +1,73 @@
+// Compiled with
+// g++ -std=c++11 -O2 launch_bench_ochell.cpp -o launch_bench_throw -l OpenCL
+// g++ -std=c++11 -O2 -DOCHELL_ERROR_MODE=OCHELL_ERROR_CODE launch_bench_ochell.cpp -o launch_bench_code -l OpenCL
+// g++ -std=c++11 -O2 -DOCHELL_ERROR_MODE=OCHELL_ERROR_NONE launch_bench_ochell.cpp -o launch_bench_none -l OpenCL
+// Usage: ./launch_bench_throw [launches (100000)]
+// Host time to set the arguments and enqueue a small vector_add, and of a
+// small blocking read, with the error mode chosen at compile time
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+
+#include "ochell.hh"
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds(Clock::time_point start, Clock::time_point end) {
+	return std::chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char **argv) {
+	int launches = argc > 1 ? std::atoi(argv[1]) : 100000;
+	const int len = 64;
+	size_t bsize = len * sizeof(int);
+
+#if OCHELL_ERROR_MODE == OCHELL_ERROR_THROW
+	const char *mode = "throw";
+#elif OCHELL_ERROR_MODE == OCHELL_ERROR_CODE
+	const char *mode = "code";
+#else
+	const char *mode = "none";
+#endif
+
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+	env.load_program("vector_add_kernel.cl");
+	cl::CommandQueue &queue = env.queue(0);
+	cl::Buffer inA = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+	cl::Buffer inB = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+	cl::Buffer outC = create_buffer(env.context, OCH_MEM_FLAGS("w"), bsize);
+	std::vector<int> A(len, 1), B(len, 2), C(len);
+	blocking_write_buffer(queue, inA, 0, bsize, &A[0]);
+	blocking_write_buffer(queue, inB, 0, bsize, &B[0]);
+
+	cl::Kernel &kern = env.kernel("vector_add");
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < launches; ++i) {
+		set_kernel_args(kern, inA, inB, outC, len);
+		enqueue_nd_range_kernel(queue, kern, cl::NullRange, cl::NDRange(len),
+			cl::NullRange);
+		// Keep the queue short
+		if (i % 1024 == 1023)
+			queue.finish();
+	}
+	queue.finish();
+	double launch = seconds(start, Clock::now());
+
+	start = Clock::now();
+	for (int i = 0; i < launches; ++i)
+		blocking_read_buffer(queue, outC, 0, sizeof(int), &C[0]);
+	double read = seconds(start, Clock::now());
+
+	std::cout << mode << ": " << launch / launches * 1e6
+		<< " us per launch, " << read / launches * 1e6
+		<< " us per blocking read" << std::endl;
+#if OCHELL_ERROR_MODE == OCHELL_ERROR_CODE
+	if (last_error().error != CL_SUCCESS)
+		std::cout << last_error().call << " failed: " << last_error().error
+			<< std::endl;
+#endif
+	std::cout << "check: " << (C[0] == 3 ? "ok" : "FAILED") << std::endl;
+
+	exit(EXIT_SUCCESS);
+}
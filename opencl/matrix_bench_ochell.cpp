@@ -0,0 +1,85 @@
+// Compiled with
+// g++ -std=c++11 -O2 matrix_bench_ochell.cpp -o matrix_bench_ochell -l OpenCL && ./matrix_bench_ochell
+// Usage: ./matrix_bench_ochell [max side (4096)] [tile size (16)]
+// Compares naive and tiled square_matrix_multiply in GFLOP/s, for sides from
+// 64 up to max side. The naive kernel at 4096 takes minutes on CPU devices
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <chrono>
+
+#include "ochell.hh"
+
+// Best time of a few runs, in seconds. If zeros is not null, it is written
+// to out before each run, untimed, so kernels adding into out see it cleared
+double time_kernel(cl::CommandQueue &queue, cl::Kernel &kern,
+	const cl::NDRange &global, const cl::NDRange &local, int runs,
+	cl::Buffer &out, const std::vector<int> *zeros = 0)
+{
+	double best = 0;
+	for (int r = 0; r < runs; ++r) {
+		if (zeros)
+			blocking_write_buffer(queue, out, 0, zeros->size() * sizeof(int),
+				&(*zeros)[0]);
+		std::chrono::steady_clock::time_point start =
+			std::chrono::steady_clock::now();
+		enqueue_nd_range_kernel(queue, kern, cl::NullRange, global, local);
+		queue.finish();
+		double t = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+		if (r == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+int main(int argc, char **argv) {
+	int max_side = argc > 1 ? std::atoi(argv[1]) : 4096;
+	int tile = argc > 2 ? std::atoi(argv[2]) : 16;
+
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+	std::string options = "-D TILE_SIZE=" + std::to_string(tile);
+	env.load_program("matrix_multiply.cl", options.c_str());
+	cl::Kernel &naive = env.kernel("square_matrix_multiply");
+	cl::Kernel &tiled = env.kernel("tiled_square_matrix_multiply");
+	cl::CommandQueue &queue = env.queue(0);
+
+	std::cout << std::setw(6) << "side" << std::setw(12) << "naive"
+		<< std::setw(12) << "tiled" << "  (GFLOP/s)" << std::endl;
+	for (int side = 64; side <= max_side; side *= 2) {
+		size_t length = (size_t)side * side;
+		size_t bsize = length * sizeof(int);
+		std::vector<int> A(length), B(length), C1(length), C2(length),
+			zeros(length, 0);
+		for (size_t i = 0; i < length; ++i) {
+			A[i] = i % 7;
+			B[i] = i % 5;
+		}
+		cl::Buffer inA = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+		cl::Buffer inB = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+		// The naive kernel reads C as it adds into it
+		cl::Buffer outC = create_buffer(env.context, OCH_MEM_FLAGS("rw"), bsize);
+		blocking_write_buffer(queue, inA, 0, bsize, &A[0]);
+		blocking_write_buffer(queue, inB, 0, bsize, &B[0]);
+
+		int runs = side <= 512 ? 5 : 1;
+		int rounded = (side + tile - 1) / tile * tile;
+		set_kernel_args(naive, outC, inA, inB, side);
+		double t_naive = time_kernel(queue, naive, cl::NDRange(side, side),
+			cl::NullRange, runs, outC, &zeros);
+		blocking_read_buffer(queue, outC, 0, bsize, &C1[0]);
+		set_kernel_args(tiled, outC, inA, inB, side);
+		double t_tiled = time_kernel(queue, tiled,
+			cl::NDRange(rounded, rounded), cl::NDRange(tile, tile), runs, outC);
+		blocking_read_buffer(queue, outC, 0, bsize, &C2[0]);
+
+		double flop = 2.0 * side * side * side;
+		std::cout << std::setw(6) << side << std::fixed << std::setprecision(2)
+			<< std::setw(12) << flop / t_naive * 1e-9
+			<< std::setw(12) << flop / t_tiled * 1e-9
+			<< (C1 == C2 ? "" : "  MISMATCH") << std::endl;
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -2,53 +2,74 @@
 // g++ -std=c++11 matrix_mult_ochell.cpp -o matrix_mult_ochell -l pocl && ./matrix_mult_ochell
 // or
 // g++ -std=c++11 matrix_mult_ochell.cpp -o matrix_mult_ochell -l OpenCL && ./matrix_mult_ochell
+// Run with OCHELL_PROFILE=1 to print kernel and transfer timings at exit
+// Pass a tile size to use the tiled kernel, e.g. ./matrix_mult_ochell 16
 
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
 
 #include "ochell.hh"
 
 int main(int argc, char **argv) {
 	int side = 5;
+	int tile = argc > 1 ? std::atoi(argv[1]) : 0;
 	int length = side * side;
-	int *A = new int[length];
-	int *B = new int[length];
-	int *C = new int[length];
-	size_t bsize = length * sizeof(int);
 
+	// Context, queues and program
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+	std::string options = "-D TILE_SIZE=" + std::to_string(tile > 0 ? tile : 16);
+	env.load_program("matrix_multiply.cl", options.c_str());
+	cl::Kernel &kern = env.kernel(tile > 0 ?
+		"tiled_square_matrix_multiply" : "square_matrix_multiply");
+
+	// Buffer objects, sized in elements, in host accessible memory so that
+	// on CPU devices mapping them does not copy data around
+	DeviceVector<int> inA(env.context, length, OCH_MEM_FLAGS("ra"));
+	DeviceVector<int> inB(env.context, length, OCH_MEM_FLAGS("ra"));
+	// The naive kernel reads C as it adds into it
+	DeviceVector<int> outC(env.context, length, OCH_MEM_FLAGS("rwa"));
+
+	// Fill the inputs and zero the output in place
+	cl::CommandQueue &queue = env.queue(0);
+	int *A = inA.map(queue, "w");
+	int *B = inB.map(queue, "w");
+	int *C = outC.map(queue, "w");
 	for (int r = 0, i = 0; r < side; ++r)
 		for (int c = 0; c < side; ++c, ++i) {
 			A[i] = (r + 1) * 100 + c;
 			B[i] = r == c ? 2 : 0;
 		}
+	std::memset(C, 0, length * sizeof(int));
+	std::vector<cl::Event> uploads;
+	uploads.push_back(inA.unmap(queue, A));
+	uploads.push_back(inB.unmap(queue, B));
+	uploads.push_back(outC.unmap(queue, C));
 
-	// Context and program
-	cl::Context ctx = create_context(CL_DEVICE_TYPE_ALL);
-	std::vector<cl::Device> devs = get_devices(ctx);
-	cl::Program prog = load_and_build_program(ctx, devs, "matrix_multiply.cl");
-	cl::Kernel kern = load_kernel(prog, "square_matrix_multiply");
-
-	// Buffer objects
-	cl::Buffer inA = create_buffer(ctx, "rh", bsize, A);
-	cl::Buffer inB = create_buffer(ctx, "rh", bsize, B);
-	cl::Buffer outC = create_buffer(ctx, "wh", bsize, C);
-
-	// Launch kernel
+	// Launch the kernel once the inputs are unmapped
 	set_kernel_args(kern, outC, inA, inB, side);
-	cl::CommandQueue queue = create_command_queue(ctx, devs[0]);
-	cl::Event event = enqueue_nd_range_kernel(
-		queue, kern, cl::NullRange, cl::NDRange(side, side), cl::NDRange(1, 1)
-	);
-	event.wait();
-	blocking_read_buffer(queue, outC, 0, bsize, C);
-	
-	// Print result matrix
+	// The tiled kernel needs whole tiles. The naive one adds into C, so it is
+	// not auto-tuned, but takes a tuned local size if one was stored
+	std::vector<cl::Event> launch;
+	if (tile > 0) {
+		int rounded = (side + tile - 1) / tile * tile;
+		launch.push_back(enqueue_nd_range_kernel(queue, kern, cl::NullRange,
+			cl::NDRange(rounded, rounded), cl::NDRange(tile, tile), uploads));
+	} else {
+		launch.push_back(enqueue_nd_range_kernel(queue, kern, cl::NullRange,
+			cl::NDRange(side, side), cl::NullRange, uploads));
+	}
+
+	// Map the result for reading, after the kernel is done, and print it
+	C = outC.map(queue, "r", launch);
 	for (int r = 0, i = 0; r < side; ++r) {
 		for (int c = 0; c < side; ++c, ++i)
 			std::cout << C[i] << " ";
 		std::cout << std::endl;
 	}
 	std::cout << std::endl;
+	outC.unmap(queue, C).wait();
+	print_program_cache_stats(std::cout);
 
 	exit(EXIT_SUCCESS);
 }
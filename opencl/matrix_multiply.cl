@@ -1,3 +1,7 @@
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+
 __kernel void square_matrix_multiply(__global int *C, __global const int *A, __global const int *B, const int side) {
 	int row = get_global_id(0);
 	int col = get_global_id(1);
@@ -7,3 +11,56 @@ __kernel void square_matrix_multiply(__global int *C, __global const int *A, __g
 		C[row * side + col] += A[row * side + i] * B[i * side + col];
 }
 
+// Same as square_matrix_multiply, but accumulating in a register and staging
+// TILE_SIZE x TILE_SIZE tiles of A and B in local memory. Run with local size
+// (TILE_SIZE, TILE_SIZE) and global sizes rounded up to multiples of it.
+// Dimension 0 runs along columns, so neighbour work-items read neighbour data
+__kernel void tiled_square_matrix_multiply(__global int *C, __global const int *A, __global const int *B, const int side) {
+	__local int tileA[TILE_SIZE][TILE_SIZE];
+	__local int tileB[TILE_SIZE][TILE_SIZE];
+	int col = get_global_id(0);
+	int row = get_global_id(1);
+	int lc = get_local_id(0);
+	int lr = get_local_id(1);
+
+	int acc = 0;
+	for (int t = 0; t < side; t += TILE_SIZE) {
+		// Out of range elements are zero, so they do not add up
+		tileA[lr][lc] = row < side && t + lc < side ? A[row * side + t + lc] : 0;
+		tileB[lr][lc] = t + lr < side && col < side ? B[(t + lr) * side + col] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (int i = 0; i < TILE_SIZE; ++i)
+			acc += tileA[lr][i] * tileB[i][lc];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (row < side && col < side)
+		C[row * side + col] = acc;
+}
+
+// Tile of C += product of a panel of A and a panel of B, all dense and
+// row-major: C is rows x cols, A is rows x inner and B is inner x cols. When
+// first is not zero, C is overwritten instead. Tiled and run as
+// tiled_square_matrix_multiply, over cols x rows. Offsets are computed in
+// size_t, as panels of large matrices may exceed 2^31 elements
+__kernel void tile_accumulate(__global int *C, __global const int *A, __global const int *B, const int rows, const int cols, const int inner, const int first) {
+	__local int tileA[TILE_SIZE][TILE_SIZE];
+	__local int tileB[TILE_SIZE][TILE_SIZE];
+	int col = get_global_id(0);
+	int row = get_global_id(1);
+	int lc = get_local_id(0);
+	int lr = get_local_id(1);
+
+	int acc = 0;
+	for (int t = 0; t < inner; t += TILE_SIZE) {
+		tileA[lr][lc] = row < rows && t + lc < inner ? A[(size_t)row * inner + t + lc] : 0;
+		tileB[lr][lc] = t + lr < inner && col < cols ? B[(size_t)(t + lr) * cols + col] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (int i = 0; i < TILE_SIZE; ++i)
+			acc += tileA[lr][i] * tileB[i][lc];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (row < rows && col < cols) {
+		size_t c = (size_t)row * cols + col;
+		C[c] = first ? acc : C[c] + acc;
+	}
+}
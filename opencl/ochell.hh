@@ -13,30 +13,62 @@ V  2. Get devices and set which to use
 V  3. Create a context
 V  4. Create a command queue
 V  5. Create buffer objects
-   7. Transfer data
+V  7. Transfer data
 V  8. Create program
    9. Link the program
-  10. Create kernel objects
+V 10. Create kernel objects
 V 11. Set arguments
   12. Execute kernel
 V 13. Read memory objects
 
 Feature:
  - Easy and quick to use
- - Automatic error reporting (TODO should have enabling flag)
+ - Automatic error reporting (OCHELL_ERROR_MODE chooses exceptions, error
+   codes or no checks)
+ - On-disk cache of program binaries (set OCHELL_CACHE_DIR, empty disables)
+ - Command timing statistics (set OCHELL_PROFILE=1 to print them at exit)
+ - Local work size autotuning (database in OCHELL_TUNING_DB)
+ - Typed kernels skipping unchanged arguments (see make_kernel)
+ - Streaming of arrays larger than device memory (see OCHStream)
+ - Buffer flag strings checked at compile time (see OCH_MEM_FLAGS)
+ - Kernel sources embedded in the binary (see embed_kernels.py, and define
+   OCHELL_EMBED_KERNELS to include the generated ochell_kernels.hh)
+ - Native fallback for small problems or missing OpenCL (see OCHDispatcher)
+ - Reductions, prefix sums, radix sort, compaction and histograms, templated
+   over element type (see reduce.cl, scan.cl, radix_sort.cl, compact.cl and
+   histogram.cl)
 */
 
 #include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <string>
 #include <vector>
 #include <fstream>
 #include <sstream>
 #include <utility>
+#include <ostream>
+#include <iostream>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <map>
+#include <type_traits>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
 #ifdef __APPLE__
 	#include <OpenCL/opencl.h>
 #else
 	#include <CL/cl.hpp>
 #endif
+#include "ochell_native.hh"
 
 // Exception type used by OCHell
 struct OCHException {
@@ -46,28 +78,429 @@ struct OCHException {
 	const cl_int error;
 };
 
-/*
-// Structure with all infos about an initialized OpenCL environment
+// Handling of the errors returned by OpenCL calls, chosen per build by
+// defining OCHELL_ERROR_MODE before including this file:
+//  OCHELL_ERROR_THROW  throw an OCHException (default)
+//  OCHELL_ERROR_CODE   store the failed call in last_error() and go on
+//  OCHELL_ERROR_NONE   do not check, leaving no branches in the helpers,
+//                      which also do not record to the profiler nor look
+//                      local sizes up in the tuning database
+// Invalid arguments given to the helpers throw in every mode
+#define OCHELL_ERROR_THROW 0
+#define OCHELL_ERROR_CODE 1
+#define OCHELL_ERROR_NONE 2
+#ifndef OCHELL_ERROR_MODE
+	#define OCHELL_ERROR_MODE OCHELL_ERROR_THROW
+#endif
+
+#if OCHELL_ERROR_MODE == OCHELL_ERROR_THROW
+	#define OCH_CHECK(error, call) do { \
+		if ((error) != CL_SUCCESS) \
+			throw OCHException(call, error); \
+	} while (0)
+#elif OCHELL_ERROR_MODE == OCHELL_ERROR_CODE
+	#define OCH_CHECK(error, call) do { \
+		if ((error) != CL_SUCCESS) \
+			set_last_error(call, error); \
+	} while (0)
+#elif OCHELL_ERROR_MODE == OCHELL_ERROR_NONE
+	#define OCH_CHECK(error, call) ((void)(error))
+#else
+	#error "OCHELL_ERROR_MODE must be OCHELL_ERROR_THROW, _CODE or _NONE"
+#endif
+
+// Whether the helpers record their events to the profiler
+#if OCHELL_ERROR_MODE == OCHELL_ERROR_NONE
+	#define OCH_PROFILING false
+#else
+	#define OCH_PROFILING (profiler().enabled)
+#endif
+
+// Last failed OpenCL call of the thread in OCHELL_ERROR_CODE mode
+struct OCHError {
+	const char *call;
+	cl_int error; // CL_SUCCESS if no call failed
+};
+
+// Get the last error of the calling thread. Assign it to reset it
+OCHError &last_error();
+
+// Timing statistics of the commands enqueued by the helpers, grouped by kernel
+// name or transfer type. When enabled, queues are created with
+// CL_QUEUE_PROFILING_ENABLE and the events of kernels and transfers are
+// recorded; their times are read once they complete. Thread-safe
+struct OCHProfiler {
+	OCHProfiler();
+	bool enabled;
+	// Record the event of a command with the given name
+	void record(const std::string &name, const cl::Event &event);
+	// Move the times of recorded events into the statistics, waiting for
+	// pending ones if wait is true
+	void collect(bool wait = true);
+	// Print count, total, min, p50 and p99 of run time (START to END) and
+	// latency (QUEUED to START) for each name, in microseconds
+	void print(std::ostream &out);
+	void reset();
+
+private:
+	struct Sample {
+		cl_ulong queued, submitted, started, ended;
+	};
+	std::vector<std::pair<std::string, cl::Event> > pending;
+	std::map<std::string, std::vector<Sample> > samples;
+	std::recursive_mutex lock;
+};
+
+// Best local work sizes found by tune_local_size, keyed by kernel name,
+// device and global size, and kept in a text file at path (memory only if
+// empty). enqueue_nd_range_kernel looks launches with a null local size up
+// here, and tunes them first if auto_tune is set: only kernels that can be
+// run more than once with the same arguments should be auto-tuned.
+// Lookups and stores are thread-safe; active() does not lock once loaded
+struct OCHTuningDatabase {
+	OCHTuningDatabase();
+	std::string path;
+	bool auto_tune;
+	// Find the local size stored for the key, false if missing
+	bool lookup(const std::string &key, cl::NDRange &local);
+	// Store the local size for the key, saving it to file
+	void store(const std::string &key, const cl::NDRange &local);
+	// True if lookups may succeed or tune
+	bool active();
+
+private:
+	void load();
+	std::atomic<bool> loaded, has_entries;
+	std::map<std::string, std::vector<size_t> > entries;
+	std::mutex lock;
+};
+
+// How to split a device into sub-devices
+enum OCHPartition {
+	OCH_PARTITION_NUMA,   // One sub-device for each NUMA node
+	OCH_PARTITION_EQUALLY // Sub-devices with the same number of compute units
+};
+
+// Structure with all infos about an initialized OpenCL environment.
+// It is meant to be long-lived: build it once and look kernels up by name
 struct OCHEnvironment {
 	// Public data
 	cl::Context context;
 	std::vector<cl::Device> devices;
 	std::vector<cl::Program> programs;
-	std::vector<cl::Kernel> kernels;
-	std::vector<cl::CommandQueue> queues;
+	std::vector<cl::CommandQueue> queues; // One per device
+	// Share of the work given to each device by split launches, from their
+	// compute units and clock at start (at least 1 each, as some devices
+	// report 0), then from measured throughput
+	std::vector<double> shares;
 
-	// Initialize OpenCL with a queue built on device with given ID and type
+	// Initialize OpenCL with a queue for each device of the given type
 	OCHEnvironment(cl_device_type type=CL_DEVICE_TYPE_ALL,
-		size_t queue_device=0);
-	void load_kernel(std::string src, 
+		cl_command_queue_properties properties=0);
+	// Initialize OpenCL with a queue for each of the given devices, which
+	// may be sub-devices obtained by partition_device
+	OCHEnvironment(const std::vector<cl::Device> &devices,
+		cl_command_queue_properties properties=0);
+	// Build a program for all the devices and register all its kernels.
+	// Kernels with the same name of already loaded ones replace them
+	cl::Program load_program(const std::string &path, const char *options=0);
+	// Get a loaded kernel by name. Kernel arguments are shared state, so
+	// a kernel object must not be used by multiple threads concurrently
+	cl::Kernel &kernel(const std::string &name);
+	// Create a new object for a loaded kernel, to be used by another thread
+	cl::Kernel new_kernel(const std::string &name);
+	// Get a kernel of the program at path built with the given options,
+	// building it on first use. These programs are kept apart from the ones
+	// of load_program, so kernels of different builds do not replace others
+	cl::Kernel &kernel(const std::string &name, const std::string &path,
+		const std::string &options);
+	// Get the queue of the given device
+	cl::CommandQueue &queue(size_t device=0);
+	// Get devices in round-robin order, to spread independent jobs over them.
+	// Safe to call from multiple threads
+	size_t next_device();
+
+private:
+	void init(cl_command_queue_properties properties);
+	std::unordered_map<std::string, cl::Kernel> kernels;
+	// Programs and kernels built with options, by path, options and name
+	std::unordered_map<std::string, cl::Program> variants;
+	std::unordered_map<std::string, cl::Kernel> variant_kernels;
+	std::atomic<size_t> next;
 };
-*/
+
+// Sequence of buffer transfers and kernel launches on a queue, recorded once
+// with symbolic buffer and host pointer slots, then replayed many times with
+// different data. Kernel arguments referring to buffer slots are set when
+// slots are bound to a different buffer, never on replay, so each launch
+// needs its own kernel object (see OCHEnvironment::new_kernel). Replay
+// enqueues all the commands and flushes once, relying on the queue order:
+// out-of-order queues are rejected
+struct OCHCommandGraph {
+	OCHCommandGraph(cl::CommandQueue &queue);
+
+	// Recording
+	// Add a symbolic buffer or host pointer slot
+	size_t buffer_slot();
+	size_t host_slot();
+	// Add a transfer of size bytes between a host slot and a buffer slot.
+	// Throws if either slot was not added
+	void write(size_t buffer, size_t host, size_t offset, size_t size);
+	void read(size_t buffer, size_t host, size_t offset, size_t size);
+	// Add a launch of the kernel, with other arguments already set.
+	// Returns the node to pass to arg
+	size_t launch(cl::Kernel &kernel, const cl::NDRange &global,
+		const cl::NDRange &local = cl::NullRange);
+	// Set the index-th argument of a launch to the buffer bound to a slot
+	void arg(size_t node, cl_uint index, size_t buffer);
+
+	// Replay
+	// Bind a slot to a buffer or host pointer
+	void bind_buffer(size_t slot, const cl::Buffer &buffer);
+	void bind_host(size_t slot, void *ptr);
+	// Enqueue all the commands, returning the event of the last one
+	cl::Event replay();
+
+	cl::CommandQueue queue;
+
+private:
+	enum NodeType { WRITE, READ, LAUNCH };
+	struct Node {
+		NodeType type;
+		size_t buffer, host, offset, size;
+		cl::Kernel kernel;
+		cl::NDRange global, local;
+	};
+	struct KernelArg {
+		size_t node, buffer;
+		cl_uint index;
+	};
+	std::vector<Node> nodes;
+	std::vector<KernelArg> args;
+	std::vector<cl::Buffer> buffers;
+	std::vector<void *> hosts;
+};
+
+// Sets the arguments of a streamed kernel for a chunk of count elements, given
+// the chunk buffers of the inputs followed by those of the outputs. Returns the
+// global size to launch
+typedef std::function<cl::NDRange(cl::Kernel &, std::vector<cl::Buffer> &,
+	size_t)> OCHStreamBinder;
+
+// Pipeline running a kernel on arrays larger than device memory, cut in chunks
+// of chunk elements. Chunks are uploaded, processed and downloaded on three
+// queues of the device, with depth sets of buffers, so the upload of a chunk,
+// the kernel on the previous one and the download of the one before overlap.
+// Host arrays allocated with aligned_host_alloc transfer faster. Chunks can
+// not be empty
+struct OCHStream {
+	OCHStream(cl::Context &context, cl::Device &device, size_t chunk,
+		size_t depth = 2);
+	// Run the kernel on arrays of count elements. Inputs and outputs are host
+	// pointers with the byte size of their elements. Waits for completion
+	void run(cl::Kernel &kernel, size_t count,
+		const std::vector<std::pair<const void *, size_t> > &inputs,
+		const std::vector<std::pair<void *, size_t> > &outputs,
+		const OCHStreamBinder &bind);
+	// Transferred gigabytes per second in the last run
+	double gbps() const;
+	// Print the statistics of the last run
+	void print(std::ostream &out) const;
+
+	cl::Context context;
+	cl::Device device;
+	size_t chunk, depth;
+	cl::CommandQueue upload, compute, download;
+	// Statistics of the last run. Busy times are the sum of the command times
+	// of each queue, and overlap is their total over the time from the first
+	// command start to the last command end: 1 when stages run one after the
+	// other, up to 3 when all of them always run together
+	double seconds; // Host time
+	size_t bytes; // Transferred in both directions
+	double upload_busy, compute_busy, download_busy, overlap;
+
+private:
+	std::vector<std::vector<cl::Buffer> > sets;
+	std::vector<size_t> layout; // Element sizes the sets were allocated for
+};
+
+// Runs the shipped kernels on host arrays, either on the first OpenCL device or
+// with the native backend of ochell_native.hh. Problems below the thresholds
+// run natively, as launches and transfers would take longer than the work;
+// all of them do if OpenCL can not be initialized. Not thread-safe
+struct OCHDispatcher {
+	// Try to initialize OpenCL on devices of the given type, and to load
+	// vector_add_kernel.cl and matrix_multiply.cl. On failure, in every error
+	// mode, env stays null (and last_error() tells why in OCHELL_ERROR_CODE)
+	OCHDispatcher(cl_device_type type = CL_DEVICE_TYPE_ALL);
+	// Whether problems above the thresholds run on OpenCL
+	bool has_opencl() const;
+	// As the vector_add and square_matrix_multiply kernels
+	void vector_add(const cl_int *A, const cl_int *B, cl_int *C, size_t len);
+	void square_matrix_multiply(cl_int *C, const cl_int *A, const cl_int *B,
+		size_t side);
+
+	size_t vector_add_threshold; // In elements
+	size_t matrix_threshold; // In side length
+	std::unique_ptr<OCHEnvironment> env; // Null without OpenCL
+};
+
+// Buffer of count elements of type T, owning its device memory. Sizes are in
+// elements, so byte sizes are right by construction. Move-only, and usable
+// directly as argument of set_kernel_args
+template <typename T>
+class DeviceVector {
+public:
+	DeviceVector();
+	// Allocate count elements, flags without host pointer ones, e.g.
+	// OCH_MEM_FLAGS("r")
+	DeviceVector(cl::Context &context, size_t count,
+		cl_mem_flags flags = CL_MEM_READ_WRITE);
+	DeviceVector(DeviceVector &&other);
+	DeviceVector &operator=(DeviceVector &&other);
+	DeviceVector(const DeviceVector &) = delete;
+	DeviceVector &operator=(const DeviceVector &) = delete;
+
+	size_t size() const;
+	size_t bytes() const;
+	cl::Buffer &buffer();
+	const cl::Buffer &buffer() const;
+
+	// Enqueue copies of count elements between host memory and the vector,
+	// starting at element offset. The whole vector if count is zero
+	cl::Event copy_from(cl::CommandQueue &queue, const T *src,
+		size_t count = 0, size_t offset = 0,
+		const std::vector<cl::Event> &wait = std::vector<cl::Event>());
+	cl::Event copy_to(cl::CommandQueue &queue, T *dst,
+		size_t count = 0, size_t offset = 0,
+		const std::vector<cl::Event> &wait = std::vector<cl::Event>());
+	// Map the whole vector in host memory, flags as map_buffer
+	T *map(cl::CommandQueue &queue, const std::string &flags,
+		const std::vector<cl::Event> &wait = std::vector<cl::Event>());
+	cl::Event unmap(cl::CommandQueue &queue, T *ptr,
+		const std::vector<cl::Event> &wait = std::vector<cl::Event>());
+
+private:
+	cl::Buffer buf;
+	size_t count;
+};
+
+// Kernel taking arguments of types Args, checked at compile time. Launches
+// set only the arguments that differ from the previous launch, and enqueue
+// the kernel in the same call. Buffers are compared by handle, and kept
+// alive while they are the current argument
+template <typename... Args>
+class OCHKernel {
+public:
+	// Throws if the kernel takes a different number of arguments
+	OCHKernel(const cl::Kernel &kernel);
+	// Set the changed arguments and enqueue the kernel
+	cl::Event operator()(cl::CommandQueue &queue, const cl::NDRange &global,
+		const cl::NDRange &local, const Args &... args);
+	// Same, after the events in wait
+	cl::Event launch(cl::CommandQueue &queue, const cl::NDRange &global,
+		const cl::NDRange &local, const std::vector<cl::Event> &wait,
+		const Args &... args);
+
+	cl::Kernel kernel;
+
+private:
+	void update(cl_uint pos);
+	template <class Tp, typename... Rest>
+	void update(cl_uint pos, const Tp &value, const Rest &... rest);
+	// Bytes of the last value of each argument, empty if never set
+	std::string last[sizeof...(Args) + 1];
+	cl::Buffer held[sizeof...(Args) + 1];
+};
+
+// On-disk cache of program binaries used by load_and_build_program.
+// Entries are keyed by a hash of source, build options, device names and
+// driver versions; the least recently used ones are evicted beyond max_entries
+struct OCHProgramCache {
+	OCHProgramCache();
+	std::string directory; // Empty to disable the cache
+	size_t max_entries;
+	size_t hits, misses, evictions;
+};
+
+// Pool of device buffers of a context, recycled in power-of-two size classes
+// for each flag set, so steady-state loops do not create buffers.
+// Acquired buffers may be larger than requested. Not thread-safe
+struct OCHBufferPool {
+	OCHBufferPool(cl::Context &context);
+	// Get a buffer of at least size bytes. Flags without host pointer ones,
+	// e.g. OCH_MEM_FLAGS("rw"), so nothing is parsed per call
+	cl::Buffer acquire(cl_mem_flags flags, size_t size);
+	// Give back a buffer obtained by acquire, for later reuse. Throws on
+	// buffers not handed out by this pool, or already released
+	void release(const cl::Buffer &buffer);
+	// Free all the buffers held for reuse
+	void clear();
+
+	cl::Context context;
+	size_t live_bytes; // Handed out and not released yet
+	size_t pool_bytes; // Held for reuse
+	size_t high_water; // Peak of live_bytes + pool_bytes
+	size_t created, reused;
+
+private:
+	typedef std::pair<cl_mem_flags, size_t> SizeClass;
+	std::map<SizeClass, std::vector<cl::Buffer> > free_buffers;
+	std::unordered_map<cl_mem, SizeClass> handed_out;
+};
+
+// Part of the rows (dimension 0) of a range assigned to a device
+struct OCHSlice {
+	size_t device; // Index of the device and queue in the environment
+	size_t offset, size;
+};
+
+// Function setting the kernel arguments for a slice, usually with
+// sub-buffers of its rows, and returning the global size of the slice
+typedef std::function<cl::NDRange(cl::Kernel &, const OCHSlice &)>
+	OCHSliceBinder;
+
+// Kernel source compiled into the program, see embed_kernels.py
+struct OCHEmbeddedSource {
+	const char *name;
+	const char *data;
+	size_t size;
+};
+
+// Name and limits in OpenCL C of a host type, to build kernels for it
+template <typename Tp>
+struct OCHTypeName;
+
+#define OCH_TYPE_NAME(type, cl_name, cl_lowest, cl_highest) \
+	template <> \
+	struct OCHTypeName<type> { \
+		static const char *name() { return cl_name; } \
+		static const char *lowest() { return cl_lowest; } \
+		static const char *highest() { return cl_highest; } \
+	};
+OCH_TYPE_NAME(cl_int, "int", "INT_MIN", "INT_MAX")
+OCH_TYPE_NAME(cl_uint, "uint", "0", "UINT_MAX")
+OCH_TYPE_NAME(cl_long, "long", "LONG_MIN", "LONG_MAX")
+OCH_TYPE_NAME(cl_ulong, "ulong", "0", "ULONG_MAX")
+OCH_TYPE_NAME(cl_float, "float", "(-INFINITY)", "INFINITY")
+OCH_TYPE_NAME(cl_double, "double", "(-INFINITY)", "INFINITY")
+#undef OCH_TYPE_NAME
 
 // Basic functions, to acess "raw" functionalites
 
 // Read a whole file inside a std::string
 std::string read_file(const std::string &path);
 
+// Register sources to be used in place of files with the same base name
+bool register_embedded_sources(const OCHEmbeddedSource *sources, size_t count);
+
+// Get the embedded source with the base name of the given path, as
+// embed_kernels.py names them, null if missing
+const OCHEmbeddedSource *find_embedded_source(const std::string &name);
+
+// Read a program source, embedded or from file
+std::string read_source(const std::string &path);
+
 // Get the list of platforms present
 std::vector<cl::Platform> get_platforms();
 
@@ -80,6 +513,9 @@ cl::Context create_context(cl_device_type type=CL_DEVICE_TYPE_ALL);
 // Create context for the specified platform
 cl::Context create_context(cl::Platform &platform,
 	cl_device_type type=CL_DEVICE_TYPE_ALL);
+
+// Create context for the specified devices
+cl::Context create_context(const std::vector<cl::Device> &devices);
 	
 // Get devices usable from a context
 std::vector<cl::Device> get_devices(const cl::Context &ctx);
@@ -87,8 +523,14 @@ std::vector<cl::Device> get_devices(const cl::Context &ctx);
 // Get devices usable from a platform
 std::vector<cl::Device> get_devices(const cl::Platform &platform,
 	cl_device_type type=CL_DEVICE_TYPE_ALL);
+
+// Split a device (usually a CPU) into sub-devices, one for each NUMA node or
+// each with the given number of compute units. Empty if the device can not
+// be split, when errors do not throw
+std::vector<cl::Device> partition_device(const cl::Device &device,
+	OCHPartition partition, size_t units = 0);
 	
-// Loads a single source file
+// Loads a single source, embedded or from file
 cl::Program::Sources load_source(const std::string &path);
 
 // Loads source files in an iterator
@@ -97,13 +539,70 @@ cl::Program::Sources load_sources(Iter paths_begin, Iter paths_end);
 
 // Set arguments to a kernel object
 template <typename... Args>
-void set_kernel_args(cl::Kernel &kernel, Args... values);
+void set_kernel_args(cl::Kernel &kernel, const Args &... values);
+
+// Set a single argument of a kernel object
+template <class Tp>
+void set_kernel_arg(cl::Kernel &kernel, cl_uint pos, const Tp &value);
+
+// Set a single argument of a kernel object to the buffer of a DeviceVector
+template <class Tp>
+void set_kernel_arg(cl::Kernel &kernel, cl_uint pos,
+	const DeviceVector<Tp> &value);
 
 // Create a buffer object using the specified flags, byte size and data
 cl::Buffer create_buffer(cl::Context &context, const std::string &flags,
 	size_t size, void *host_ptr=NULL);
 
-// Create a command queue for the given context and device
+// Create a buffer object using the region of size bytes starting at offset of
+// a buffer. Offset must be aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN
+cl::Buffer create_sub_buffer(cl::Buffer &buffer, size_t offset, size_t size,
+	cl_mem_flags flags = 0);
+
+// Create a buffer object using already parsed flags
+cl::Buffer create_buffer(cl::Context &context, cl_mem_flags flags,
+	size_t size, void *host_ptr=NULL);
+
+// Convert a flag string as used by create_buffer into cl_mem_flags. Throws on
+// unknown flags, on 'h' together with 'a' or 'c', and on repeated access
+// flags ("rwr")
+cl_mem_flags parse_buffer_flags(const std::string &flags);
+
+// Same as parse_buffer_flags, usable in constant expressions. Invalid flags
+// are compile errors when evaluated at compile time
+constexpr cl_mem_flags buffer_flags(const char *flags);
+
+// Flags of a literal string, parsed and checked at compile time, e.g.
+// create_buffer(context, OCH_MEM_FLAGS("rh"), size, ptr)
+#define OCH_MEM_FLAGS(flags) \
+	(std::integral_constant<cl_mem_flags, buffer_flags(flags)>::value)
+
+// Get the alignment in bytes (CL_DEVICE_MEM_BASE_ADDR_ALIGN) that host
+// pointers need to be used without copies
+size_t get_host_alignment(const cl::Device &device);
+
+// Get the largest host pointer alignment among the devices of a context
+size_t get_host_alignment(const cl::Context &context);
+
+// Allocate host memory usable without copies by 'h' buffers of the context
+void *aligned_host_alloc(const cl::Context &context, size_t size);
+
+// Free memory allocated with aligned_host_alloc
+void aligned_host_free(void *ptr);
+
+// Map size bytes starting at offset of the buffer in host memory, after the
+// events in wait. Flags are 'r' to read and 'w' to write the mapped region.
+// On CPU devices, buffers created with 'a' are mapped without copies
+void *map_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
+	const std::string &flags, size_t offset, size_t size,
+	const std::vector<cl::Event> &wait = std::vector<cl::Event>());
+
+// Enqueue the unmap of a pointer returned by map_buffer
+cl::Event unmap_buffer(cl::CommandQueue &queue, cl::Buffer &buffer, void *ptr,
+	const std::vector<cl::Event> &wait = std::vector<cl::Event>());
+
+// Create a command queue for the given context and device. Profiling is
+// enabled on the queue if the profiler is
 cl::CommandQueue create_command_queue(cl::Context &context, cl::Device &device,
 	cl_command_queue_properties properties = 0);
 
@@ -111,28 +610,254 @@ cl::CommandQueue create_command_queue(cl::Context &context, cl::Device &device,
 void blocking_read_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
 	size_t offset, size_t size, void *ptr);
 
+// Write size bytes from ptr into the buffer starting at offset
+void blocking_write_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
+	size_t offset, size_t size, const void *ptr);
+
+// Enqueue a read of size bytes starting at offset from the buffer into ptr,
+// after the events in wait. ptr is filled when the returned event completes
+cl::Event enqueue_read_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
+	size_t offset, size_t size, void *ptr,
+	const std::vector<cl::Event> &wait = std::vector<cl::Event>());
+
+// Enqueue a write of size bytes from ptr into the buffer starting at offset,
+// after the events in wait. ptr must be valid until the returned event completes
+cl::Event enqueue_write_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
+	size_t offset, size_t size, const void *ptr,
+	const std::vector<cl::Event> &wait = std::vector<cl::Event>());
+
 // Build a program for the specified devices
 void build_program(cl::Program &program, std::vector<cl::Device> &devices,
 	const char *options = 0);
 
-// Load a program from a file and built it for the specified devices
+// Load a program from a file and built it for the specified devices.
+// Device binaries are taken from (and stored into) the program cache
 cl::Program load_and_build_program(cl::Context &context,
-	std::vector<cl::Device> &devices, const std::string &path);
+	std::vector<cl::Device> &devices, const std::string &path,
+	const char *options = 0);
+
+// Get the program cache shared by all the programs built
+OCHProgramCache &program_cache();
+
+// Print hit/miss/eviction counts of the program cache
+void print_program_cache_stats(std::ostream &out);
+
+// Print memory usage and reuse counts of a buffer pool
+void print_buffer_pool_stats(std::ostream &out, const OCHBufferPool &pool);
+
+// Get the profiler shared by all the helpers
+OCHProfiler &profiler();
+
+// Get the tuning database shared by all the helpers
+OCHTuningDatabase &tuning_database();
+
+// Time the kernel over the global size with candidate local sizes that
+// respect CL_KERNEL_WORK_GROUP_SIZE and are multiples of the preferred size,
+// and store the fastest in the tuning database. Kernel arguments must be set
+cl::NDRange tune_local_size(cl::CommandQueue &queue, cl::Kernel &kernel,
+	const cl::NDRange &global, size_t repeats = 5);
 	
-// Enqueue a kernel to be run with specified working element counts
+// Enqueue a kernel to be run with specified working element counts,
+// after the events in wait. If local is cl::NullRange, the local size is
+// taken from the tuning database when present (not in OCHELL_ERROR_NONE
+// mode, which leaves only the launch)
 cl::Event enqueue_nd_range_kernel(cl::CommandQueue &queue, cl::Kernel kernel,
 	const cl::NDRange &offset, const cl::NDRange &global,
-	const cl::NDRange &local);
+	const cl::NDRange &local,
+	const std::vector<cl::Event> &wait = std::vector<cl::Event>());
 
 // Load a kernel with given name from the program
 cl::Kernel load_kernel(cl::Program &program, const std::string &entry_point);
 
+// Load all the kernels in the program
+std::vector<cl::Kernel> load_kernels(cl::Program &program);
+
+// Load a kernel with given name and argument types from the program
+template <typename... Args>
+OCHKernel<Args...> make_kernel(cl::Program &program,
+	const std::string &entry_point);
+
+// Split size rows proportionally to shares, in multiples of granularity.
+// Shares that are not positive count as zero, and equal if all are
+std::vector<OCHSlice> split_rows(size_t size, const std::vector<double> &shares,
+	size_t granularity = 1);
+
+// Split rows over all the devices of the environment according to their
+// shares, and run the kernel on each slice on the queue of its device, with
+// the arguments set by bind. Waits for completion, then updates the shares
+// with the measured throughput: kernel times if queues have profiling
+// enabled, else the time each slice took to complete, noted by an event
+// callback
+void run_split_kernel(OCHEnvironment &env, const std::string &kernel_name,
+	size_t rows, size_t granularity, const OCHSliceBinder &bind);
+
+// Helpers for the kernels shipped along OCHell
+
+// Width of the vector_add variant suiting a device: 1 (scalar vector_add),
+// 4, 8 or 16, the largest not above CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT
+size_t vector_add_width(const cl::Device &device);
+
+// Name of the vector_add variant of the given width
+std::string vector_add_kernel_name(size_t width);
+
+// Global size to run the vector_add variant of the given width on len
+// elements, when the program is built with the given ELEMS_PER_ITEM
+cl::NDRange vector_add_global(size_t width, size_t len,
+	size_t elems_per_item = 4);
+
+// Run vector_add on all the devices of the environment, each on sub-buffers
+// of its slice of the int arrays
+void split_vector_add(OCHEnvironment &env, cl::Buffer &A, cl::Buffer &B,
+	cl::Buffer &C, size_t len);
+
+// Run square_matrix_multiply on all the devices of the environment, each
+// computing a band of rows of C from the same rows of A and the whole B
+void split_square_matrix_multiply(OCHEnvironment &env, cl::Buffer &C,
+	cl::Buffer &A, cl::Buffer &B, size_t side);
+
+// Multiply the side x side int matrices A and B in host memory into C on the
+// first device of the environment, using at most budget bytes of device
+// memory. Tiles of C accumulate the products of panels of A and B, which
+// are uploaded while the previous panels are multiplied; finished tiles are
+// read back while the next one is computed. The kernel of matrix_multiply.cl
+// is built for tile_size on first use. Throws if the budget can not hold six
+// tile_size x tile_size blocks, or the kernel can not run groups that large
+void out_of_core_square_matrix_multiply(OCHEnvironment &env, cl_int *C,
+	const cl_int *A, const cl_int *B, size_t side, size_t budget,
+	size_t tile_size = 16);
+
+// Add len ints of the host arrays A and B into C with vector_add, streaming
+// them through the device of the stream. vector_add_kernel.cl must be loaded
+void stream_vector_add(OCHEnvironment &env, OCHStream &stream, const cl_int *A,
+	const cl_int *B, cl_int *C, size_t len);
+
+// Reduce n elements of type T in the buffer with the kernels of reduce.cl,
+// built for each type and operation on first use, on the queue of the given
+// device. Only the result is read back. op is an OpenCL C expression of a
+// and b without spaces, identity its identity element
+template <typename T>
+T reduce(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	const std::string &op, const std::string &identity, size_t device = 0);
+
+// Sum, minimum and maximum of n elements of type T in the buffer
+template <typename T>
+T reduce_sum(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	size_t device = 0);
+template <typename T>
+T reduce_min(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	size_t device = 0);
+template <typename T>
+T reduce_max(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	size_t device = 0);
+
+// Index of the largest of n elements of type T in the buffer, the first one
+// among equals. n must not be 0
+template <typename T>
+size_t reduce_argmax(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	size_t device = 0);
+
+// Same, on all the elements of a DeviceVector
+template <typename T>
+T reduce_sum(OCHEnvironment &env, const DeviceVector<T> &in,
+	size_t device = 0);
+template <typename T>
+T reduce_min(OCHEnvironment &env, const DeviceVector<T> &in,
+	size_t device = 0);
+template <typename T>
+T reduce_max(OCHEnvironment &env, const DeviceVector<T> &in,
+	size_t device = 0);
+template <typename T>
+size_t reduce_argmax(OCHEnvironment &env, const DeviceVector<T> &in,
+	size_t device = 0);
+
+// Prefix sums of n elements of type T from in into out, which may be the same
+// buffer, with the kernels of scan.cl on the queue of the given device.
+// Inclusive sums count the element itself, exclusive ones start from 0.
+// Returns the event of the last command
+template <typename T>
+cl::Event inclusive_scan(OCHEnvironment &env, const cl::Buffer &in,
+	cl::Buffer &out, size_t n, size_t device = 0);
+template <typename T>
+cl::Event exclusive_scan(OCHEnvironment &env, const cl::Buffer &in,
+	cl::Buffer &out, size_t n, size_t device = 0);
+
+// Same, on all the elements of DeviceVectors of the same size
+template <typename T>
+cl::Event inclusive_scan(OCHEnvironment &env, const DeviceVector<T> &in,
+	DeviceVector<T> &out, size_t device = 0);
+template <typename T>
+cl::Event exclusive_scan(OCHEnvironment &env, const DeviceVector<T> &in,
+	DeviceVector<T> &out, size_t device = 0);
+
+// Sort n keys of type K, 32 or 64 bit integers, in the buffer, in place and
+// stable, with the radix sort of radix_sort.cl on the queue of the given
+// device. n must be below 2^32. Returns the event of the last command
+template <typename K>
+cl::Event sort(OCHEnvironment &env, cl::Buffer &keys, size_t n,
+	size_t device = 0);
+
+// Same, moving the n values of type V along with their keys
+template <typename K, typename V>
+cl::Event sort(OCHEnvironment &env, cl::Buffer &keys, cl::Buffer &values,
+	size_t n, size_t device = 0);
+
+// Same, on all the elements of DeviceVectors
+template <typename K>
+cl::Event sort(OCHEnvironment &env, DeviceVector<K> &keys, size_t device = 0);
+template <typename K, typename V>
+cl::Event sort(OCHEnvironment &env, DeviceVector<K> &keys,
+	DeviceVector<V> &values, size_t device = 0);
+
+// Copy the elements of type T of in for which predicate holds to the start of
+// out, in order, with the kernels of compact.cl on the queue of the given
+// device. predicate is an OpenCL C expression of the element x and of arg,
+// without spaces. n must be below 2^32. Returns the number of copied
+// elements, the only data read back
+template <typename T>
+size_t compact(OCHEnvironment &env, const cl::Buffer &in, cl::Buffer &out,
+	size_t n, const std::string &predicate, T arg = T(), size_t device = 0);
+
+// Same, on all the elements of DeviceVectors of the same size
+template <typename T>
+size_t compact(OCHEnvironment &env, const DeviceVector<T> &in,
+	DeviceVector<T> &out, const std::string &predicate, T arg = T(),
+	size_t device = 0);
+
+// Same, reading back only the copied elements
+template <typename T>
+std::vector<T> compact_to_host(OCHEnvironment &env, const cl::Buffer &in,
+	size_t n, const std::string &predicate, T arg = T(), size_t device = 0);
+
+// Count the n elements of type T of in falling in each of bins equal ranges
+// of [lo, hi), with the kernel of histogram.cl on the queue of the given
+// device. Values outside are not counted. The bins must fit in the local
+// memory of the device, and lo must be below hi. Only the counts are read back
+template <typename T>
+std::vector<cl_uint> histogram(OCHEnvironment &env, const cl::Buffer &in,
+	size_t n, size_t bins, T lo, T hi, size_t device = 0);
+
+// Same, on all the elements of a DeviceVector
+template <typename T>
+std::vector<cl_uint> histogram(OCHEnvironment &env, const DeviceVector<T> &in,
+	size_t bins, T lo, T hi, size_t device = 0);
+
 ///////////////////////////////////////////////////////////////////////////////
 ////////////////////////////// Implementation /////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
 // Exception structure
 
+OCHError &last_error() {
+	static thread_local OCHError error = { "", CL_SUCCESS };
+	return error;
+}
+
+// Private implementation, do not use this
+void set_last_error(const char *call, cl_int error) {
+	last_error().call = call;
+	last_error().error = error;
+}
+
 OCHException::OCHException(const std::string &w, cl_int e):
 	message(w), error(e) {
 }
@@ -143,225 +868,2312 @@ std::string OCHException::what() const {
 	return ss.str();
 }
 
-// Environment structure
-/*
-OCHEnvironment::OCHEnvironment(cl_device_type type, size_t queue_device) {
-	context = create_context(type);
-	devices = get_devices(ctx);
-	queue = create_command_queue(context, devices[queue_device]);
+// Private implementation, do not use this
+// Create a directory and its missing parents
+void make_directories(const std::string &path) {
+	for (size_t i = 1; i <= path.size(); ++i)
+		if (i == path.size() || path[i] == '/')
+			mkdir(path.substr(0, i).c_str(), 0755);
 }
-*/
-// Basic functions
 
-std::string read_file(const std::string &path) {
-	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
-	if (in) {
-		std::string contents;
-		in.seekg(0, std::ios::end);
-		contents.resize(in.tellg());
-		in.seekg(0, std::ios::beg);
-		in.read(&contents[0], contents.size());
-		in.close();
-		return(contents);
-	}
-	throw OCHException("ifstream::ifstream()", errno);
-}
+// Program cache structure
 
-std::vector<cl::Platform> get_platforms() {
-	std::vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	return platforms;
+OCHProgramCache::OCHProgramCache():
+	max_entries(64), hits(0), misses(0), evictions(0)
+{
+	const char *dir = std::getenv("OCHELL_CACHE_DIR");
+	const char *home = std::getenv("HOME");
+	if (dir)
+		directory = dir;
+	else if (home)
+		directory = std::string(home) + "/.cache/ochell";
 }
 
-std::string get_vendor(const cl::Platform &pl) {
-	std::string vendor;
-	pl.getInfo(CL_PLATFORM_VENDOR, &vendor);
-	return vendor;
+// Buffer pool structure
+
+OCHBufferPool::OCHBufferPool(cl::Context &ctx):
+	context(ctx), live_bytes(0), pool_bytes(0), high_water(0),
+	created(0), reused(0)
+{
 }
 
-cl::Context create_context(cl_device_type type) {
-	std::vector<cl::Platform> platforms = get_platforms();
-	if (platforms.size() == 0)
-		throw OCHException("create_context() no platforms available", 0);
-	return create_context(platforms[0], type);
+cl::Buffer OCHBufferPool::acquire(cl_mem_flags flags, size_t size) {
+	if (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR))
+		throw OCHException("OCHBufferPool::acquire() host pointer flags",
+			CL_INVALID_VALUE);
+	size_t class_size = 256;
+	while (class_size < size)
+		class_size <<= 1;
+
+	SizeClass size_class(flags, class_size);
+	std::vector<cl::Buffer> &free_list = free_buffers[size_class];
+	cl::Buffer buffer;
+	if (!free_list.empty()) {
+		buffer = free_list.back();
+		free_list.pop_back();
+		pool_bytes -= class_size;
+		reused++;
+	} else {
+		buffer = create_buffer(context, flags, class_size);
+		created++;
+	}
+	handed_out[buffer()] = size_class;
+	live_bytes += class_size;
+	high_water = std::max(high_water, live_bytes + pool_bytes);
+	return buffer;
 }
 
-cl::Context create_context(cl::Platform &platform, cl_device_type type) {
-	cl_context_properties props[3] = {
-		CL_CONTEXT_PLATFORM, (cl_context_properties)(platform)(), 0
-	};
-	cl_int error;
-	cl::Context context(type, props, 0, 0, &error);
-	if (error != CL_SUCCESS)
-		throw OCHException("Context::Context()", error);
-	return context;
+void OCHBufferPool::release(const cl::Buffer &buffer) {
+	std::unordered_map<cl_mem, SizeClass>::iterator it =
+		handed_out.find(buffer());
+	if (it == handed_out.end())
+		throw OCHException("OCHBufferPool::release() buffer not acquired",
+			CL_INVALID_MEM_OBJECT);
+	SizeClass size_class = it->second;
+	handed_out.erase(it);
+	free_buffers[size_class].push_back(buffer);
+	live_bytes -= size_class.second;
+	pool_bytes += size_class.second;
 }
 
-std::vector<cl::Device> get_devices(const cl::Context &ctx) {
-	return ctx.getInfo<CL_CONTEXT_DEVICES>();
+void OCHBufferPool::clear() {
+	free_buffers.clear();
+	pool_bytes = 0;
 }
 
-std::vector<cl::Device> get_devices(const cl::Platform &platform,
-	cl_device_type type)
-{
-	std::vector<cl::Device> devices;
-	cl_int error = platform.getDevices(type, &devices);
-	if (error != CL_SUCCESS)
-		throw OCHException("Platform::getDevices()", error);
-	return devices;
+// Profiler structure
+
+OCHProfiler::OCHProfiler(): enabled(false) {
+	const char *env = std::getenv("OCHELL_PROFILE");
+	enabled = env && std::string(env) != "0";
 }
 
-cl::Program::Sources load_source(const std::string &path) {
-	std::string src_str = read_file(path);
-	const char *src_cstr = src_str.c_str();
-	size_t src_len = src_str.size() + 1;
-	// Sources is a vector
-	cl::Program::Sources source(1, std::make_pair(src_cstr, src_len));
-	return source;
+void OCHProfiler::record(const std::string &name, const cl::Event &event) {
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	pending.push_back(std::make_pair(name, event));
+	// Keep the pending list short in long runs, without stalling the queues
+	if (pending.size() >= 1024)
+		collect(false);
 }
 
-template <class Iter>
-cl::Program::Sources load_sources(Iter paths_begin, Iter paths_end) {
-	cl::Program::Sources sources; // Vector class
-	while (paths_begin != paths_end) {
-		std::string src_str = read_file(*paths_begin);
-		const char *src_cstr = src_str.c_str();
-		size_t src_len = src_str.size() + 1;
-		sources.push_back(std::make_pair(src_cstr, src_len));
-		paths_begin++;
+void OCHProfiler::collect(bool wait) {
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	std::vector<std::pair<std::string, cl::Event> > waiting;
+	for (size_t i = 0; i < pending.size(); ++i) {
+		cl::Event &event = pending[i].second;
+		if (wait)
+			event.wait();
+		else if (event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+			waiting.push_back(pending[i]);
+			continue;
+		}
+		Sample s;
+		s.queued = event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+		s.submitted = event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+		s.started = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		s.ended = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		samples[pending[i].first].push_back(s);
 	}
-	return sources;
+	pending.swap(waiting);
 }
 
-template <class Tp>
-void set_kernel_args(cl::Kernel &kernel, int pos, int count, Tp value) {
-	if (count > 0) {
-		cl_int error = kernel.setArg(pos, value);
-		if (error != CL_SUCCESS)
-			throw OCHException("Kernel::setArg()", error);
+// Private implementation, do not use this
+// Print count, total, min, p50 and p99 of a list of durations in ns
+void print_durations(std::ostream &out, std::vector<cl_ulong> &ns) {
+	std::sort(ns.begin(), ns.end());
+	cl_ulong total = 0;
+	for (size_t i = 0; i < ns.size(); ++i)
+		total += ns[i];
+	// Nearest-rank percentiles
+	size_t p50 = (ns.size() * 50 + 99) / 100 - 1;
+	size_t p99 = (ns.size() * 99 + 99) / 100 - 1;
+	out << " total " << total / 1000.0 << " min " << ns[0] / 1000.0
+		<< " p50 " << ns[p50] / 1000.0 << " p99 " << ns[p99] / 1000.0;
+}
+
+void OCHProfiler::print(std::ostream &out) {
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	collect();
+	out << "INFO: profile (us)" << std::endl;
+	std::map<std::string, std::vector<Sample> >::iterator it;
+	for (it = samples.begin(); it != samples.end(); ++it) {
+		std::vector<Sample> &list = it->second;
+		std::vector<cl_ulong> run, latency;
+		for (size_t i = 0; i < list.size(); ++i) {
+			run.push_back(list[i].ended - list[i].started);
+			latency.push_back(list[i].started - list[i].queued);
+		}
+		out << "  " << it->first << ": count " << list.size() << "\n    run    ";
+		print_durations(out, run);
+		out << "\n    latency";
+		print_durations(out, latency);
+		out << std::endl;
 	}
 }
 
-// Private implementation, do not use this
-template <class Tp, typename... Args>
-void set_kernel_args(cl::Kernel &kernel, int pos, int count, Tp value,
-	Args... values)
+void OCHProfiler::reset() {
+	std::lock_guard<std::recursive_mutex> guard(lock);
+	pending.clear();
+	samples.clear();
+}
+
+// Tuning database structure
+
+OCHTuningDatabase::OCHTuningDatabase(): auto_tune(false), loaded(false),
+	has_entries(false)
 {
-	if (count > 0) {
-		cl_int error = kernel.setArg(pos, value);
-		if (error != CL_SUCCESS)
-			throw OCHException("Kernel::setArg()", error);
-		set_kernel_args(kernel, pos + 1, count - 1, values...);
+	const char *db = std::getenv("OCHELL_TUNING_DB");
+	const char *home = std::getenv("HOME");
+	if (db)
+		path = db;
+	else if (home)
+		path = std::string(home) + "/.cache/ochell/tuning.txt";
+}
+
+void OCHTuningDatabase::load() {
+	std::ifstream in(path.c_str());
+	std::string line;
+	// Lines are the key, a tab and the local sizes. Later lines win
+	while (std::getline(in, line)) {
+		size_t tab = line.find('\t');
+		if (tab == std::string::npos)
+			continue;
+		std::istringstream sizes(line.substr(tab + 1));
+		std::vector<size_t> local;
+		size_t size;
+		while (sizes >> size)
+			local.push_back(size);
+		entries[line.substr(0, tab)] = local;
 	}
+	has_entries = !entries.empty();
+	// Last, so active() reads the entries flag only after it is set
+	loaded = true;
 }
 
-// This is the function version to use
-template <typename... Args>
-void set_kernel_args(cl::Kernel &kernel, Args... values) {
-	static const int size = sizeof...(Args);
-	set_kernel_args(kernel, 0, size, values...);
+bool OCHTuningDatabase::lookup(const std::string &key, cl::NDRange &local) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (!loaded)
+		load();
+	std::map<std::string, std::vector<size_t> >::iterator it = entries.find(key);
+	if (it == entries.end())
+		return false;
+	const std::vector<size_t> &l = it->second;
+	switch (l.size()) {
+		case 1: local = cl::NDRange(l[0]); break;
+		case 2: local = cl::NDRange(l[0], l[1]); break;
+		case 3: local = cl::NDRange(l[0], l[1], l[2]); break;
+		default: local = cl::NullRange;
+	}
+	return true;
 }
 
-cl::Buffer create_buffer(cl::Context &context, const std::string &flag_str,
-	size_t size, void *host_ptr)
-{
-	cl_mem_flags flags = 0;
-	for (size_t i = 0; i < flag_str.size(); ++i) {
-		switch (flag_str[i]) {
-			case 'r':
-				if (flags & CL_MEM_WRITE_ONLY) {
-					flags = flags ^ CL_MEM_WRITE_ONLY; // Disable write
-					flags = flags | CL_MEM_READ_WRITE; // Enable read-write
-				}
-				else
-					flags = flags | CL_MEM_READ_ONLY; // Enable only read
-				break;
-			case 'w':
-				if (flags & CL_MEM_READ_ONLY) {
-					flags = flags ^ CL_MEM_READ_ONLY; // Disable write
-					flags = flags | CL_MEM_READ_WRITE; // Enable read-write
-				}
-				else
-					flags = flags | CL_MEM_WRITE_ONLY; // Enable only read
-				break;
-			case 'h':
-				flags = flags | CL_MEM_USE_HOST_PTR;
-				break;
-			case 'a':
-				flags = flags | CL_MEM_ALLOC_HOST_PTR;
-				break;
-			case 'c':
-				flags = flags | CL_MEM_COPY_HOST_PTR;
-				break;
-			default:
-				throw OCHException("create_buffer() invalid flag", flag_str[i]);
-		}
+void OCHTuningDatabase::store(const std::string &key, const cl::NDRange &local) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (!loaded)
+		load();
+	std::vector<size_t> &l = entries[key];
+	has_entries = true;
+	l.assign((const size_t *)local, (const size_t *)local + local.dimensions());
+	if (path.empty())
+		return;
+	size_t slash = path.rfind('/');
+	if (slash != std::string::npos && slash > 0)
+		make_directories(path.substr(0, slash));
+	std::ofstream out(path.c_str(), std::ios::out | std::ios::app);
+	out << key << '\t';
+	for (size_t i = 0; i < l.size(); ++i)
+		out << l[i] << ' ';
+	out << std::endl;
+}
+
+bool OCHTuningDatabase::active() {
+	if (!loaded) {
+		std::lock_guard<std::mutex> guard(lock);
+		if (!loaded)
+			load();
 	}
-	cl_int error;
-	cl::Buffer buff(context, flags, size, host_ptr, &error);
-	if (error != CL_SUCCESS)
-		throw OCHException("Buffer::Buffer()", error);
-	return buff;
+	return auto_tune || has_entries;
 }
 
-cl::CommandQueue create_command_queue(cl::Context &context, cl::Device &device,
-	cl_command_queue_properties properties)
+// Environment structure
+
+OCHEnvironment::OCHEnvironment(cl_device_type type,
+	cl_command_queue_properties properties): next(0)
 {
-	cl_int error;
-	cl::CommandQueue queue(context, device, properties, &error);
-	if (error != CL_SUCCESS)
-		throw OCHException("CommandQueue::CommandQueue()", error);
-	return queue;
+	context = create_context(type);
+	devices = get_devices(context);
+	init(properties);
 }
 
-void blocking_read_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
-	size_t offset, size_t size, void *ptr)
+OCHEnvironment::OCHEnvironment(const std::vector<cl::Device> &devs,
+	cl_command_queue_properties properties): devices(devs), next(0)
 {
-	cl_int error = queue.enqueueReadBuffer(buffer, CL_TRUE, offset, size, ptr);
-	if (error != CL_SUCCESS)
-		throw OCHException("Queue::enqueueReadBuffer()", error);
+	context = create_context(devices);
+	init(properties);
 }
 
-void build_program(cl::Program &program, std::vector<cl::Device> &devices,
+void OCHEnvironment::init(cl_command_queue_properties properties) {
+	for (size_t i = 0; i < devices.size(); ++i) {
+		queues.push_back(create_command_queue(context, devices[i], properties));
+		shares.push_back(std::max(1.0,
+			(double)devices[i].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() *
+			devices[i].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>()));
+	}
+}
+
+cl::Program OCHEnvironment::load_program(const std::string &path,
 	const char *options)
 {
-	cl_int error = program.build(devices, options);
-	if (error != CL_SUCCESS)
-		throw OCHException("Program::build()", error);
+	programs.push_back(load_and_build_program(context, devices, path, options));
+	std::vector<cl::Kernel> loaded = load_kernels(programs.back());
+	for (size_t i = 0; i < loaded.size(); ++i)
+		kernels[loaded[i].getInfo<CL_KERNEL_FUNCTION_NAME>()] = loaded[i];
+	return programs.back();
+}
+
+cl::Kernel &OCHEnvironment::kernel(const std::string &name) {
+	std::unordered_map<std::string, cl::Kernel>::iterator it =
+		kernels.find(name);
+	if (it == kernels.end())
+		throw OCHException("OCHEnvironment::kernel() not loaded: " + name,
+			CL_INVALID_KERNEL_NAME);
+	return it->second;
+}
+
+cl::Kernel OCHEnvironment::new_kernel(const std::string &name) {
+	cl::Program program = kernel(name).getInfo<CL_KERNEL_PROGRAM>();
+	return load_kernel(program, name);
+}
+
+cl::Kernel &OCHEnvironment::kernel(const std::string &name,
+	const std::string &path, const std::string &options)
+{
+	std::string key = path + '\n' + options;
+	std::unordered_map<std::string, cl::Kernel>::iterator it =
+		variant_kernels.find(key + '\n' + name);
+	if (it != variant_kernels.end())
+		return it->second;
+	std::unordered_map<std::string, cl::Program>::iterator prog =
+		variants.find(key);
+	if (prog == variants.end())
+		prog = variants.insert(std::make_pair(key, load_and_build_program(
+			context, devices, path, options.c_str()))).first;
+	return variant_kernels[key + '\n' + name] =
+		load_kernel(prog->second, name);
+}
+
+cl::CommandQueue &OCHEnvironment::queue(size_t device) {
+	return queues.at(device);
+}
+
+size_t OCHEnvironment::next_device() {
+	return next++ % devices.size();
+}
+
+// Command graph structure
+
+OCHCommandGraph::OCHCommandGraph(cl::CommandQueue &q): queue(q) {
+	if (queue.getInfo<CL_QUEUE_PROPERTIES>() &
+		CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+		throw OCHException("OCHCommandGraph() out-of-order queue",
+			CL_INVALID_COMMAND_QUEUE);
+}
+
+size_t OCHCommandGraph::buffer_slot() {
+	buffers.push_back(cl::Buffer());
+	return buffers.size() - 1;
+}
+
+size_t OCHCommandGraph::host_slot() {
+	hosts.push_back(0);
+	return hosts.size() - 1;
+}
+
+void OCHCommandGraph::write(size_t buffer, size_t host, size_t offset,
+	size_t size)
+{
+	if (buffer >= buffers.size() || host >= hosts.size())
+		throw OCHException("OCHCommandGraph::write() no such slot",
+			CL_INVALID_VALUE);
+	Node node;
+	node.type = WRITE;
+	node.buffer = buffer;
+	node.host = host;
+	node.offset = offset;
+	node.size = size;
+	nodes.push_back(node);
+}
+
+void OCHCommandGraph::read(size_t buffer, size_t host, size_t offset,
+	size_t size)
+{
+	if (buffer >= buffers.size() || host >= hosts.size())
+		throw OCHException("OCHCommandGraph::read() no such slot",
+			CL_INVALID_VALUE);
+	Node node;
+	node.type = READ;
+	node.buffer = buffer;
+	node.host = host;
+	node.offset = offset;
+	node.size = size;
+	nodes.push_back(node);
+}
+
+size_t OCHCommandGraph::launch(cl::Kernel &kernel, const cl::NDRange &global,
+	const cl::NDRange &local)
+{
+	Node node;
+	node.type = LAUNCH;
+	node.kernel = kernel;
+	node.global = global;
+	node.local = local;
+	nodes.push_back(node);
+	return nodes.size() - 1;
+}
+
+void OCHCommandGraph::arg(size_t node, cl_uint index, size_t buffer) {
+	KernelArg a = { node, buffer, index };
+	args.push_back(a);
+	if (buffers.at(buffer)() == 0)
+		return; // Set when bound
+	cl_int error = nodes.at(node).kernel.setArg(index, buffers[buffer]);
+	OCH_CHECK(error, "Kernel::setArg()");
+}
+
+void OCHCommandGraph::bind_buffer(size_t slot, const cl::Buffer &buffer) {
+	if (buffers.at(slot)() == buffer())
+		return;
+	buffers[slot] = buffer;
+	for (size_t i = 0; i < args.size(); ++i) {
+		if (args[i].buffer != slot)
+			continue;
+		cl_int error = nodes[args[i].node].kernel.setArg(args[i].index, buffer);
+		OCH_CHECK(error, "Kernel::setArg()");
+	}
+}
+
+void OCHCommandGraph::bind_host(size_t slot, void *ptr) {
+	hosts.at(slot) = ptr;
+}
+
+cl::Event OCHCommandGraph::replay() {
+	// The queue is in order, so only the last command needs an event
+	cl::Event last;
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		Node &n = nodes[i];
+		cl::Event *event = i + 1 == nodes.size() ? &last : 0;
+		cl_int error = CL_SUCCESS;
+		switch (n.type) {
+			case WRITE:
+				error = queue.enqueueWriteBuffer(buffers[n.buffer], CL_FALSE,
+					n.offset, n.size, hosts[n.host], 0, event);
+				break;
+			case READ:
+				error = queue.enqueueReadBuffer(buffers[n.buffer], CL_FALSE,
+					n.offset, n.size, hosts[n.host], 0, event);
+				break;
+			case LAUNCH:
+				error = queue.enqueueNDRangeKernel(n.kernel, cl::NullRange,
+					n.global, n.local, 0, event);
+				break;
+		}
+		OCH_CHECK(error, "OCHCommandGraph::replay()");
+	}
+	queue.flush();
+	return last;
+}
+
+// Streaming pipeline
+
+OCHStream::OCHStream(cl::Context &ctx, cl::Device &dev, size_t chunk_size,
+	size_t buffer_sets): context(ctx), device(dev), chunk(chunk_size),
+	depth(std::max(buffer_sets, (size_t)1)), seconds(0), bytes(0),
+	upload_busy(0), compute_busy(0), download_busy(0), overlap(0)
+{
+	if (chunk == 0)
+		throw OCHException("OCHStream() empty chunks", CL_INVALID_VALUE);
+	// Profiling is needed for the busy times
+	upload = create_command_queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	compute = create_command_queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+	download = create_command_queue(context, device,
+		CL_QUEUE_PROFILING_ENABLE);
+}
+
+// Private implementation, do not use this
+// Sum of the run times of the events, and their first start and last end
+double busy_time(const std::vector<cl::Event> &events, cl_ulong &first,
+	cl_ulong &last)
+{
+	cl_ulong busy = 0;
+	for (size_t i = 0; i < events.size(); ++i) {
+		cl_ulong start = events[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		cl_ulong end = events[i].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		busy += end - start;
+		first = std::min(first, start);
+		last = std::max(last, end);
+	}
+	return busy * 1e-9;
+}
+
+void OCHStream::run(cl::Kernel &kernel, size_t count,
+	const std::vector<std::pair<const void *, size_t> > &inputs,
+	const std::vector<std::pair<void *, size_t> > &outputs,
+	const OCHStreamBinder &bind)
+{
+	std::vector<size_t> sizes;
+	for (size_t a = 0; a < inputs.size(); ++a)
+		sizes.push_back(inputs[a].second);
+	for (size_t a = 0; a < outputs.size(); ++a)
+		sizes.push_back(outputs[a].second);
+	if (sizes != layout) {
+		sets.assign(depth, std::vector<cl::Buffer>());
+		for (size_t s = 0; s < depth; ++s)
+			for (size_t a = 0; a < sizes.size(); ++a)
+				sets[s].push_back(create_buffer(context, a < inputs.size() ?
+					CL_MEM_READ_ONLY : CL_MEM_WRITE_ONLY, chunk * sizes[a]));
+		layout = sizes;
+	}
+
+	// Events of the commands of each stage, and of the end of each chunk
+	std::vector<cl::Event> uploads, launches, downloads, done;
+	std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	for (size_t c = 0, offset = 0; offset < count; ++c, offset += chunk) {
+		size_t n = std::min(chunk, count - offset);
+		std::vector<cl::Buffer> &set = sets[c % depth];
+		// The set is free when the chunk that used it is downloaded
+		std::vector<cl::Event> wait;
+		if (c >= depth)
+			wait.push_back(done[c - depth]);
+		for (size_t a = 0; a < inputs.size(); ++a) {
+			const char *host = (const char *)inputs[a].first;
+			uploads.push_back(enqueue_write_buffer(upload, set[a], 0,
+				n * sizes[a], host + offset * sizes[a], wait));
+		}
+		// In-order queue: the last upload completes after the others
+		if (!inputs.empty())
+			wait.assign(1, uploads.back());
+		cl::NDRange global = bind(kernel, set, n);
+		launches.push_back(enqueue_nd_range_kernel(compute, kernel,
+			cl::NullRange, global, cl::NullRange, wait));
+		wait.assign(1, launches.back());
+		for (size_t a = 0; a < outputs.size(); ++a) {
+			size_t b = inputs.size() + a;
+			char *host = (char *)outputs[a].first;
+			downloads.push_back(enqueue_read_buffer(download, set[b], 0,
+				n * sizes[b], host + offset * sizes[b], wait));
+		}
+		// Last command of the chunk, queues being in order
+		done.push_back(outputs.empty() ? launches.back() : downloads.back());
+		// Uploads of later chunks wait on the downloads, from another queue
+		upload.flush();
+		compute.flush();
+		download.flush();
+	}
+	if (!done.empty())
+		done.back().wait();
+	seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+
+	bytes = 0;
+	for (size_t a = 0; a < sizes.size(); ++a)
+		bytes += count * sizes[a];
+	cl_ulong first = ~(cl_ulong)0, last = 0;
+	upload_busy = busy_time(uploads, first, last);
+	compute_busy = busy_time(launches, first, last);
+	download_busy = busy_time(downloads, first, last);
+	overlap = last > first ? (upload_busy + compute_busy + download_busy) /
+		((last - first) * 1e-9) : 0;
+}
+
+double OCHStream::gbps() const {
+	return seconds > 0 ? bytes / seconds * 1e-9 : 0;
+}
+
+void OCHStream::print(std::ostream &out) const {
+	out << bytes * 1e-6 << " MB in " << seconds * 1e3 << " ms, " << gbps()
+		<< " GB/s, busy ms upload " << upload_busy * 1e3 << " kernel "
+		<< compute_busy * 1e3 << " download " << download_busy * 1e3
+		<< ", overlap " << overlap << std::endl;
+}
+
+// Basic functions
+
+// Private implementation, do not use this
+// The C++ bindings want a null pointer for empty wait lists
+const std::vector<cl::Event> *wait_list(const std::vector<cl::Event> &wait) {
+	return wait.empty() ? 0 : &wait;
+}
+
+std::string read_file(const std::string &path) {
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	if (in) {
+		std::string contents;
+		in.seekg(0, std::ios::end);
+		contents.resize(in.tellg());
+		in.seekg(0, std::ios::beg);
+		in.read(&contents[0], contents.size());
+		in.close();
+		return(contents);
+	}
+	throw OCHException("ifstream::ifstream()", errno);
+}
+
+// Private implementation, do not use this
+std::map<std::string, OCHEmbeddedSource> &embedded_sources() {
+	static std::map<std::string, OCHEmbeddedSource> sources;
+	return sources;
+}
+
+bool register_embedded_sources(const OCHEmbeddedSource *sources, size_t count) {
+	for (size_t i = 0; i < count; ++i)
+		embedded_sources()[sources[i].name] = sources[i];
+	return true;
+}
+
+const OCHEmbeddedSource *find_embedded_source(const std::string &name) {
+	std::map<std::string, OCHEmbeddedSource> &sources = embedded_sources();
+	if (sources.empty())
+		return 0;
+	// "kernels/scan.cl" and "scan.cl" are the same source
+	size_t slash = name.find_last_of("/\\");
+	std::string base = slash == std::string::npos ? name :
+		name.substr(slash + 1);
+	std::map<std::string, OCHEmbeddedSource>::const_iterator it =
+		sources.find(base);
+	return it == sources.end() ? 0 : &it->second;
+}
+
+std::string read_source(const std::string &path) {
+	const OCHEmbeddedSource *embedded = find_embedded_source(path);
+	if (embedded)
+		return std::string(embedded->data, embedded->size);
+	return read_file(path);
+}
+
+std::vector<cl::Platform> get_platforms() {
+	std::vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	return platforms;
+}
+
+std::string get_vendor(const cl::Platform &pl) {
+	std::string vendor;
+	pl.getInfo(CL_PLATFORM_VENDOR, &vendor);
+	return vendor;
+}
+
+cl::Context create_context(cl_device_type type) {
+	std::vector<cl::Platform> platforms = get_platforms();
+	if (platforms.size() == 0)
+		throw OCHException("create_context() no platforms available", 0);
+	return create_context(platforms[0], type);
+}
+
+cl::Context create_context(cl::Platform &platform, cl_device_type type) {
+	cl_context_properties props[3] = {
+		CL_CONTEXT_PLATFORM, (cl_context_properties)(platform)(), 0
+	};
+	cl_int error;
+	cl::Context context(type, props, 0, 0, &error);
+	OCH_CHECK(error, "Context::Context()");
+	return context;
+}
+
+cl::Context create_context(const std::vector<cl::Device> &devices) {
+	cl_int error;
+	cl::Context context(devices, 0, 0, 0, &error);
+	OCH_CHECK(error, "Context::Context()");
+	return context;
+}
+
+std::vector<cl::Device> get_devices(const cl::Context &ctx) {
+	return ctx.getInfo<CL_CONTEXT_DEVICES>();
+}
+
+std::vector<cl::Device> get_devices(const cl::Platform &platform,
+	cl_device_type type)
+{
+	std::vector<cl::Device> devices;
+	cl_int error = platform.getDevices(type, &devices);
+	OCH_CHECK(error, "Platform::getDevices()");
+	return devices;
+}
+
+std::vector<cl::Device> partition_device(const cl::Device &device,
+	OCHPartition partition, size_t units)
+{
+	cl_device_partition_property props[3] = { 0, 0, 0 };
+	if (partition == OCH_PARTITION_NUMA) {
+		props[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+		props[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+	}
+	else {
+		props[0] = CL_DEVICE_PARTITION_EQUALLY;
+		props[1] = (cl_device_partition_property)units;
+	}
+	// Ask the number of sub-devices first
+	cl_uint count = 0;
+	cl_int error = clCreateSubDevices(device(), props, 0, 0, &count);
+	OCH_CHECK(error, "clCreateSubDevices()");
+	std::vector<cl::Device> devices;
+	if (error != CL_SUCCESS || count == 0)
+		return devices;
+	std::vector<cl_device_id> ids(count);
+	error = clCreateSubDevices(device(), props, count, &ids[0], 0);
+	OCH_CHECK(error, "clCreateSubDevices()");
+	if (error != CL_SUCCESS)
+		return devices;
+	// The wrappers take ownership of the new sub-devices
+	for (size_t i = 0; i < ids.size(); ++i)
+		devices.push_back(cl::Device(ids[i]));
+	return devices;
+}
+
+cl::Program::Sources load_source(const std::string &path) {
+	// Embedded sources are static, so they can be referenced directly
+	const OCHEmbeddedSource *embedded = find_embedded_source(path);
+	if (embedded)
+		return cl::Program::Sources(1,
+			std::make_pair(embedded->data, embedded->size + 1));
+	std::string src_str = read_file(path);
+	const char *src_cstr = src_str.c_str();
+	size_t src_len = src_str.size() + 1;
+	// Sources is a vector
+	cl::Program::Sources source(1, std::make_pair(src_cstr, src_len));
+	return source;
+}
+
+template <class Iter>
+cl::Program::Sources load_sources(Iter paths_begin, Iter paths_end) {
+	cl::Program::Sources sources; // Vector class
+	while (paths_begin != paths_end) {
+		std::string src_str = read_file(*paths_begin);
+		const char *src_cstr = src_str.c_str();
+		size_t src_len = src_str.size() + 1;
+		sources.push_back(std::make_pair(src_cstr, src_len));
+		paths_begin++;
+	}
+	return sources;
+}
+
+template <class Tp>
+void set_kernel_arg(cl::Kernel &kernel, cl_uint pos, const Tp &value) {
+	cl_int error = kernel.setArg(pos, value);
+	OCH_CHECK(error, "Kernel::setArg()");
+}
+
+template <class Tp>
+void set_kernel_arg(cl::Kernel &kernel, cl_uint pos,
+	const DeviceVector<Tp> &value)
+{
+	set_kernel_arg(kernel, pos, value.buffer());
+}
+
+// Private implementation, do not use these
+void set_kernel_args_from(cl::Kernel &, cl_uint) {
+}
+
+template <class Tp, typename... Args>
+void set_kernel_args_from(cl::Kernel &kernel, cl_uint pos, const Tp &value,
+	const Args &... values)
+{
+	set_kernel_arg(kernel, pos, value);
+	set_kernel_args_from(kernel, pos + 1, values...);
+}
+
+// This is the function version to use
+template <typename... Args>
+void set_kernel_args(cl::Kernel &kernel, const Args &... values) {
+	set_kernel_args_from(kernel, 0, values...);
+}
+
+// Private implementation, do not use these
+constexpr cl_mem_flags add_buffer_flag(cl_mem_flags flags, char flag) {
+	return flag == 'r' ? (flags & CL_MEM_WRITE_ONLY ?
+			(flags ^ CL_MEM_WRITE_ONLY) | CL_MEM_READ_WRITE : // Read-write
+			flags | CL_MEM_READ_ONLY) : // Only read
+		flag == 'w' ? (flags & CL_MEM_READ_ONLY ?
+			(flags ^ CL_MEM_READ_ONLY) | CL_MEM_READ_WRITE : // Read-write
+			flags | CL_MEM_WRITE_ONLY) : // Only write
+		flag == 'h' ? flags | CL_MEM_USE_HOST_PTR :
+		flag == 'a' ? flags | CL_MEM_ALLOC_HOST_PTR :
+		flag == 'c' ? flags | CL_MEM_COPY_HOST_PTR :
+		throw OCHException("create_buffer() invalid flag", flag);
+}
+
+constexpr cl_mem_flags check_buffer_flags(cl_mem_flags flags) {
+	// A single access mode, as 'r' after "rw" adds read-only to read-write
+	return ((flags & CL_MEM_READ_WRITE ? 1 : 0) +
+			(flags & CL_MEM_READ_ONLY ? 1 : 0) +
+			(flags & CL_MEM_WRITE_ONLY ? 1 : 0)) > 1 ?
+		throw OCHException("create_buffer() repeated 'r' or 'w'",
+			CL_INVALID_VALUE) :
+	// Host memory can be either used or allocated/copied by OpenCL
+		(flags & CL_MEM_USE_HOST_PTR) &&
+			(flags & (CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR)) ?
+		throw OCHException("create_buffer() 'h' with 'a' or 'c'",
+			CL_INVALID_VALUE) :
+		flags;
+}
+
+constexpr cl_mem_flags buffer_flags_from(const char *flags,
+	cl_mem_flags parsed)
+{
+	return *flags == '\0' ? check_buffer_flags(parsed) :
+		buffer_flags_from(flags + 1, add_buffer_flag(parsed, *flags));
+}
+
+constexpr cl_mem_flags buffer_flags(const char *flags) {
+	return buffer_flags_from(flags, 0);
+}
+
+cl_mem_flags parse_buffer_flags(const std::string &flag_str) {
+	cl_mem_flags flags = 0;
+	for (size_t i = 0; i < flag_str.size(); ++i)
+		flags = add_buffer_flag(flags, flag_str[i]);
+	return check_buffer_flags(flags);
+}
+
+cl::Buffer create_buffer(cl::Context &context, const std::string &flag_str,
+	size_t size, void *host_ptr)
+{
+	return create_buffer(context, parse_buffer_flags(flag_str), size, host_ptr);
+}
+
+cl::Buffer create_sub_buffer(cl::Buffer &buffer, size_t offset, size_t size,
+	cl_mem_flags flags)
+{
+	cl_buffer_region region = { offset, size };
+	cl_int error;
+	cl::Buffer sub = buffer.createSubBuffer(flags, CL_BUFFER_CREATE_TYPE_REGION,
+		&region, &error);
+	OCH_CHECK(error, "Buffer::createSubBuffer()");
+	return sub;
+}
+
+cl::Buffer create_buffer(cl::Context &context, cl_mem_flags flags,
+	size_t size, void *host_ptr)
+{
+	cl_int error;
+	cl::Buffer buff(context, flags, size, host_ptr, &error);
+	OCH_CHECK(error, "Buffer::Buffer()");
+	return buff;
+}
+
+size_t get_host_alignment(const cl::Device &device) {
+	// Reported in bits
+	return device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+}
+
+size_t get_host_alignment(const cl::Context &context) {
+	std::vector<cl::Device> devices = get_devices(context);
+	size_t alignment = sizeof(void *);
+	for (size_t i = 0; i < devices.size(); ++i)
+		alignment = std::max(alignment, get_host_alignment(devices[i]));
+	return alignment;
+}
+
+void *aligned_host_alloc(const cl::Context &context, size_t size) {
+	size_t alignment = get_host_alignment(context);
+	// Round the size too, so the last block is not shared with other data
+	size = (size + alignment - 1) / alignment * alignment;
+	void *ptr = 0;
+	int error = posix_memalign(&ptr, alignment, size);
+	if (error != 0)
+		throw OCHException("posix_memalign()", error);
+	return ptr;
+}
+
+void aligned_host_free(void *ptr) {
+	std::free(ptr);
+}
+
+void *map_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
+	const std::string &flag_str, size_t offset, size_t size,
+	const std::vector<cl::Event> &wait)
+{
+	cl_map_flags flags = 0;
+	for (size_t i = 0; i < flag_str.size(); ++i) {
+		switch (flag_str[i]) {
+			case 'r':
+				flags = flags | CL_MAP_READ;
+				break;
+			case 'w':
+				flags = flags | CL_MAP_WRITE;
+				break;
+			default:
+				throw OCHException("map_buffer() invalid flag", flag_str[i]);
+		}
+	}
+	cl_int error;
+	void *ptr = queue.enqueueMapBuffer(buffer, CL_TRUE, flags, offset, size,
+		wait_list(wait), 0, &error);
+	OCH_CHECK(error, "Queue::enqueueMapBuffer()");
+	return ptr;
+}
+
+cl::Event unmap_buffer(cl::CommandQueue &queue, cl::Buffer &buffer, void *ptr,
+	const std::vector<cl::Event> &wait)
+{
+	cl::Event event;
+	cl_int error = queue.enqueueUnmapMemObject(buffer, ptr, wait_list(wait),
+		&event);
+	OCH_CHECK(error, "Queue::enqueueUnmapMemObject()");
+	return event;
+}
+
+cl::CommandQueue create_command_queue(cl::Context &context, cl::Device &device,
+	cl_command_queue_properties properties)
+{
+	if (OCH_PROFILING)
+		properties = properties | CL_QUEUE_PROFILING_ENABLE;
+	cl_int error;
+	cl::CommandQueue queue(context, device, properties, &error);
+	OCH_CHECK(error, "CommandQueue::CommandQueue()");
+	return queue;
+}
+
+void blocking_read_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
+	size_t offset, size_t size, void *ptr)
+{
+	cl::Event event;
+	cl_int error = queue.enqueueReadBuffer(buffer, CL_TRUE, offset, size, ptr,
+		0, OCH_PROFILING ? &event : 0);
+	OCH_CHECK(error, "Queue::enqueueReadBuffer()");
+	if (OCH_PROFILING)
+		profiler().record("read_buffer", event);
+}
+
+void blocking_write_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
+	size_t offset, size_t size, const void *ptr)
+{
+	cl::Event event;
+	cl_int error = queue.enqueueWriteBuffer(buffer, CL_TRUE, offset, size, ptr,
+		0, OCH_PROFILING ? &event : 0);
+	OCH_CHECK(error, "Queue::enqueueWriteBuffer()");
+	if (OCH_PROFILING)
+		profiler().record("write_buffer", event);
+}
+
+cl::Event enqueue_read_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
+	size_t offset, size_t size, void *ptr, const std::vector<cl::Event> &wait)
+{
+	cl::Event event;
+	cl_int error = queue.enqueueReadBuffer(buffer, CL_FALSE, offset, size, ptr,
+		wait_list(wait), &event);
+	OCH_CHECK(error, "Queue::enqueueReadBuffer()");
+	if (OCH_PROFILING)
+		profiler().record("read_buffer", event);
+	return event;
+}
+
+cl::Event enqueue_write_buffer(cl::CommandQueue &queue, cl::Buffer &buffer,
+	size_t offset, size_t size, const void *ptr,
+	const std::vector<cl::Event> &wait)
+{
+	cl::Event event;
+	cl_int error = queue.enqueueWriteBuffer(buffer, CL_FALSE, offset, size, ptr,
+		wait_list(wait), &event);
+	OCH_CHECK(error, "Queue::enqueueWriteBuffer()");
+	if (OCH_PROFILING)
+		profiler().record("write_buffer", event);
+	return event;
+}
+
+void build_program(cl::Program &program, std::vector<cl::Device> &devices,
+	const char *options)
+{
+	cl_int error = program.build(devices, options);
+	OCH_CHECK(error, "Program::build()");
+}
+
+// Private implementation of the program cache, do not use these
+
+// 64 bit FNV-1a hash, chained through h
+unsigned long long cache_hash(const std::string &data,
+	unsigned long long h = 14695981039346656037ULL)
+{
+	for (size_t i = 0; i < data.size(); ++i) {
+		h ^= (unsigned char)data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+std::string cache_entry_path(const std::string &source, const char *options,
+	const std::vector<cl::Device> &devices)
+{
+	unsigned long long h = cache_hash(source);
+	h = cache_hash(options ? options : "", h);
+	for (size_t i = 0; i < devices.size(); ++i) {
+		h = cache_hash(devices[i].getInfo<CL_DEVICE_NAME>(), h);
+		h = cache_hash(devices[i].getInfo<CL_DRIVER_VERSION>(), h);
+	}
+	char name[32];
+	std::sprintf(name, "/%016llx.bin", h);
+	return program_cache().directory + name;
+}
+
+// Read the binaries of an entry, one per device. False if missing or corrupt
+bool cache_load(const std::string &path, size_t count,
+	std::vector<std::string> &binaries)
+{
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	size_t stored = 0;
+	if (!in || !in.read((char *)&stored, sizeof(stored)) || stored != count)
+		return false;
+	binaries.resize(count);
+	for (size_t i = 0; i < count; ++i) {
+		size_t size = 0;
+		if (!in.read((char *)&size, sizeof(size)))
+			return false;
+		binaries[i].resize(size);
+		if (size == 0 || !in.read(&binaries[i][0], size))
+			return false;
+	}
+	// Mark the entry as recently used
+	utime(path.c_str(), 0);
+	return true;
+}
+
+// Remove least recently used entries, keeping at most max_entries
+void cache_evict() {
+	OCHProgramCache &cache = program_cache();
+	DIR *dir = opendir(cache.directory.c_str());
+	if (!dir)
+		return;
+	std::vector<std::pair<time_t, std::string> > entries;
+	while (struct dirent *ent = readdir(dir)) {
+		std::string name(ent->d_name);
+		if (name.size() < 4 || name.compare(name.size() - 4, 4, ".bin") != 0)
+			continue;
+		std::string path = cache.directory + "/" + name;
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0)
+			entries.push_back(std::make_pair(st.st_mtime, path));
+	}
+	closedir(dir);
+	if (entries.size() <= cache.max_entries)
+		return;
+	std::sort(entries.begin(), entries.end());
+	for (size_t i = 0; i < entries.size() - cache.max_entries; ++i)
+		if (std::remove(entries[i].second.c_str()) == 0)
+			cache.evictions++;
+}
+
+// Store the binaries of a built program, in the order of devices
+void cache_store(const std::string &path, cl::Program &program,
+	const std::vector<cl::Device> &devices)
+{
+	OCHProgramCache &cache = program_cache();
+	// Binaries are reported in the order of the program devices
+	std::vector<cl::Device> prog_devs = program.getInfo<CL_PROGRAM_DEVICES>();
+	std::vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+	std::vector<std::string> blobs(prog_devs.size());
+	std::vector<unsigned char *> ptrs(prog_devs.size());
+	for (size_t i = 0; i < prog_devs.size(); ++i) {
+		blobs[i].resize(sizes[i] + 1);
+		ptrs[i] = (unsigned char *)&blobs[i][0];
+	}
+	cl_int error = clGetProgramInfo(program(), CL_PROGRAM_BINARIES,
+		ptrs.size() * sizeof(unsigned char *), &ptrs[0], 0);
+	if (error != CL_SUCCESS)
+		return;
+
+	make_directories(cache.directory);
+	std::string tmp = path + ".tmp";
+	std::ofstream out(tmp.c_str(), std::ios::out | std::ios::binary);
+	size_t count = devices.size();
+	out.write((const char *)&count, sizeof(count));
+	for (size_t d = 0; d < devices.size(); ++d) {
+		size_t i = 0;
+		while (i < prog_devs.size() && prog_devs[i]() != devices[d]())
+			++i;
+		size_t size = i < prog_devs.size() ? sizes[i] : 0;
+		out.write((const char *)&size, sizeof(size));
+		if (size > 0)
+			out.write(blobs[i].data(), size);
+	}
+	out.close();
+	// Rename is atomic, so concurrent processes never read partial entries
+	if (!out || std::rename(tmp.c_str(), path.c_str()) != 0) {
+		std::remove(tmp.c_str());
+		return;
+	}
+	cache_evict();
 }
 
 cl::Program load_and_build_program(cl::Context &context,
-	std::vector<cl::Device> &devices, const std::string &path)
+	std::vector<cl::Device> &devices, const std::string &path,
+	const char *options)
 {
-	cl::Program program(context, load_source(path));
-	build_program(program, devices);
+	std::string source = read_source(path);
+	OCHProgramCache &cache = program_cache();
+	std::string entry;
+	if (!cache.directory.empty()) {
+		entry = cache_entry_path(source, options, devices);
+		std::vector<std::string> blobs;
+		if (cache_load(entry, devices.size(), blobs)) {
+			cl::Program::Binaries binaries;
+			for (size_t i = 0; i < blobs.size(); ++i)
+				binaries.push_back(std::make_pair(
+					(const void *)blobs[i].data(), blobs[i].size()));
+			cl_int error;
+			cl::Program program(context, devices, binaries, 0, &error);
+			if (error == CL_SUCCESS &&
+				program.build(devices, options) == CL_SUCCESS)
+			{
+				cache.hits++;
+				return program;
+			}
+			// Binary rejected by the driver, drop the stale entry
+			std::remove(entry.c_str());
+			cache.evictions++;
+		}
+		cache.misses++;
+	}
+
+	// The source string must outlive the program creation
+	cl::Program::Sources sources(1,
+		std::make_pair(source.c_str(), source.size()));
+	cl::Program program(context, sources);
+	build_program(program, devices, options);
+	if (!entry.empty())
+		cache_store(entry, program, devices);
 	return program;
 }
 
+OCHProgramCache &program_cache() {
+	static OCHProgramCache cache;
+	return cache;
+}
+
+void print_program_cache_stats(std::ostream &out) {
+	const OCHProgramCache &cache = program_cache();
+	out << "INFO: program cache " << cache.hits << " hits, "
+		<< cache.misses << " misses, " << cache.evictions << " evictions";
+	if (cache.directory.empty())
+		out << " (disabled)";
+	out << std::endl;
+}
+
+// Private implementation, do not use this
+void print_profile_at_exit() {
+	profiler().print(std::cerr);
+}
+
+OCHTuningDatabase &tuning_database() {
+	static OCHTuningDatabase db;
+	return db;
+}
+
+OCHProfiler &profiler() {
+	static OCHProfiler prof;
+	// Registered after construction, so it runs before the destructor
+	static bool at_exit = prof.enabled && std::atexit(print_profile_at_exit) == 0;
+	(void)at_exit;
+	return prof;
+}
+
+void print_buffer_pool_stats(std::ostream &out, const OCHBufferPool &pool) {
+	out << "INFO: buffer pool " << pool.live_bytes << " live bytes, "
+		<< pool.pool_bytes << " pooled bytes, " << pool.high_water
+		<< " high-water bytes, " << pool.created << " created, "
+		<< pool.reused << " reused" << std::endl;
+}
+
+// Private implementation of the autotuner, do not use these
+
+std::string tuning_key(cl::CommandQueue &queue, cl::Kernel &kernel,
+	const cl::NDRange &global)
+{
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	std::ostringstream key;
+	key << kernel.getInfo<CL_KERNEL_FUNCTION_NAME>() << '|'
+		<< device.getInfo<CL_DEVICE_NAME>() << '|'
+		<< device.getInfo<CL_DRIVER_VERSION>() << '|';
+	for (size_t i = 0; i < global.dimensions(); ++i)
+		key << (i ? "x" : "") << ((const size_t *)global)[i];
+	return key.str();
+}
+
+// Local sizes with power of two sides dividing the global ones
+void tuning_candidates(const cl::NDRange &global, size_t dim,
+	size_t max_size, const std::vector<size_t> &max_sides,
+	std::vector<size_t> &local, std::vector<cl::NDRange> &found)
+{
+	if (dim == global.dimensions()) {
+		found.push_back(local.size() == 1 ? cl::NDRange(local[0]) :
+			local.size() == 2 ? cl::NDRange(local[0], local[1]) :
+			cl::NDRange(local[0], local[1], local[2]));
+		return;
+	}
+	size_t used = 1;
+	for (size_t i = 0; i < local.size(); ++i)
+		used *= local[i];
+	size_t side = ((const size_t *)global)[dim];
+	for (size_t l = 1; used * l <= max_size && l <= max_sides[dim]; l <<= 1) {
+		if (side % l != 0)
+			break;
+		local.push_back(l);
+		tuning_candidates(global, dim + 1, max_size, max_sides, local, found);
+		local.pop_back();
+	}
+}
+
+// Best of repeated runs in seconds, negative if the launch fails
+double time_launch(cl::CommandQueue &queue, cl::Kernel &kernel,
+	const cl::NDRange &global, const cl::NDRange &local, size_t repeats)
+{
+	double best = -1;
+	// One more run, to warm up
+	for (size_t r = 0; r <= repeats; ++r) {
+		std::chrono::steady_clock::time_point start =
+			std::chrono::steady_clock::now();
+		cl_int error = queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+			global, local);
+		if (error == CL_SUCCESS)
+			error = queue.finish();
+		if (error != CL_SUCCESS)
+			return -1;
+		double t = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+		if (r > 0 && (best < 0 || t < best))
+			best = t;
+	}
+	return best;
+}
+
+cl::NDRange tune_local_size(cl::CommandQueue &queue, cl::Kernel &kernel,
+	const cl::NDRange &global, size_t repeats)
+{
+	cl::Device device = queue.getInfo<CL_QUEUE_DEVICE>();
+	size_t max_size = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+	size_t multiple = kernel.getWorkGroupInfo<
+		CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+	std::vector<size_t> max_sides =
+		device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+	std::vector<cl::NDRange> all, candidates;
+	std::vector<size_t> local;
+	tuning_candidates(global, 0, max_size, max_sides, local, all);
+	// Keep multiples of the preferred size, unless none of them fits
+	for (size_t i = 0; i < all.size(); ++i) {
+		size_t size = 1;
+		for (size_t d = 0; d < all[i].dimensions(); ++d)
+			size *= ((const size_t *)all[i])[d];
+		if (size % multiple == 0)
+			candidates.push_back(all[i]);
+	}
+	if (candidates.empty())
+		candidates = all;
+
+	// The runtime choice competes too
+	cl::NDRange best = cl::NullRange;
+	double best_time = time_launch(queue, kernel, global, best, repeats);
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		double t = time_launch(queue, kernel, global, candidates[i], repeats);
+		if (t >= 0 && (best_time < 0 || t < best_time)) {
+			best = candidates[i];
+			best_time = t;
+		}
+	}
+	tuning_database().store(tuning_key(queue, kernel, global), best);
+	return best;
+}
+
 cl::Event enqueue_nd_range_kernel(cl::CommandQueue &queue, cl::Kernel kernel,
 	const cl::NDRange &offset, const cl::NDRange &global,
-	const cl::NDRange &local)
+	const cl::NDRange &local, const std::vector<cl::Event> &wait)
 {
+	// Use the tuned local size, if the caller did not choose one
+	cl::NDRange tuned = local;
+#if OCHELL_ERROR_MODE != OCHELL_ERROR_NONE
+	if (local.dimensions() == 0 && tuning_database().active()) {
+		std::string key = tuning_key(queue, kernel, global);
+		if (!tuning_database().lookup(key, tuned) &&
+			tuning_database().auto_tune)
+		{
+			// Inputs must be ready before timing
+			if (!wait.empty())
+				cl::Event::waitForEvents(wait);
+			tuned = tune_local_size(queue, kernel, global);
+		}
+	}
+#endif
 	// Create an event to query the status of the execution
 	cl::Event event;
 	// Execute the kernel
-	cl_int error = queue.enqueueNDRangeKernel(kernel, offset, global, local,
-		0, &event);
+	cl_int error = queue.enqueueNDRangeKernel(kernel, offset, global, tuned,
+		wait_list(wait), &event);
 
-	if (error != CL_SUCCESS)
-		throw OCHException("CommandQueue::enqueueNDRangeKernel()", error);
+	OCH_CHECK(error, "CommandQueue::enqueueNDRangeKernel()");
+	if (OCH_PROFILING)
+		profiler().record(kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), event);
 	return event;
 }
 
 cl::Kernel load_kernel(cl::Program &program, const std::string &entry_point) {
 	cl_int error;
 	cl::Kernel kernel(program, entry_point.c_str(), &error);
-	if (error != CL_SUCCESS)
-		throw OCHException("Kernel::Kernel()", error);
+	OCH_CHECK(error, "Kernel::Kernel()");
 	return kernel;
 }
 
+std::vector<cl::Kernel> load_kernels(cl::Program &program) {
+	std::vector<cl::Kernel> kernels;
+	cl_int error = program.createKernels(&kernels);
+	OCH_CHECK(error, "Program::createKernels()");
+	return kernels;
+}
+
+std::vector<OCHSlice> split_rows(size_t size, const std::vector<double> &shares,
+	size_t granularity)
+{
+	std::vector<double> used(shares.size(), 1.0);
+	double total = 0;
+	for (size_t i = 0; i < shares.size(); ++i)
+		total += shares[i] > 0 ? shares[i] : 0;
+	if (total > 0)
+		for (size_t i = 0; i < shares.size(); ++i)
+			used[i] = shares[i] > 0 ? shares[i] : 0;
+	else
+		total = (double)shares.size();
+	std::vector<OCHSlice> slices;
+	size_t offset = 0;
+	for (size_t i = 0; i < shares.size() && offset < size; ++i) {
+		size_t part = size - offset;
+		if (i + 1 < shares.size()) {
+			double exact = size * used[i] / total / granularity;
+			part = std::min(part, (size_t)(exact + 0.5) * granularity);
+		}
+		if (part == 0)
+			continue;
+		OCHSlice slice = { i, offset, part };
+		slices.push_back(slice);
+		offset += part;
+	}
+	return slices;
+}
+
+// Private implementation, do not use these
+// Completion times of the slices of a split launch, from its start, noted by
+// event callbacks so slow slices do not delay the times of faster ones
+struct OCHSliceTimes {
+	std::chrono::steady_clock::time_point start;
+	std::vector<double> seconds;
+	size_t pending;
+	std::mutex lock;
+	std::condition_variable completed;
+};
+
+struct OCHSliceTimer {
+	OCHSliceTimes *times;
+	size_t slice;
+};
+
+void CL_CALLBACK slice_completed(cl_event, cl_int, void *data) {
+	OCHSliceTimer *timer = (OCHSliceTimer *)data;
+	OCHSliceTimes &times = *timer->times;
+	std::lock_guard<std::mutex> guard(times.lock);
+	times.seconds[timer->slice] = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - times.start).count();
+	if (--times.pending == 0)
+		times.completed.notify_all();
+}
+
+void run_split_kernel(OCHEnvironment &env, const std::string &kernel_name,
+	size_t rows, size_t granularity, const OCHSliceBinder &bind)
+{
+	cl::Kernel &kernel = env.kernel(kernel_name);
+	std::vector<OCHSlice> slices = split_rows(rows, env.shares, granularity);
+	// Slices on queues without profiling are timed by callbacks
+	std::vector<bool> profiled(slices.size());
+	std::vector<OCHSliceTimer> timers(slices.size());
+	OCHSliceTimes times;
+	times.seconds.assign(slices.size(), -1.0);
+	times.pending = 0;
+	for (size_t i = 0; i < slices.size(); ++i) {
+		profiled[i] = (env.queue(slices[i].device).getInfo<
+			CL_QUEUE_PROPERTIES>() & CL_QUEUE_PROFILING_ENABLE) != 0;
+		timers[i].times = &times;
+		timers[i].slice = i;
+	}
+	// Arguments are captured at enqueue, so one kernel serves all slices
+	std::vector<cl::Event> events;
+	times.start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < slices.size(); ++i) {
+		cl::CommandQueue &queue = env.queue(slices[i].device);
+		cl::NDRange global = bind(kernel, slices[i]);
+		events.push_back(enqueue_nd_range_kernel(queue, kernel, cl::NullRange,
+			global, cl::NullRange));
+		if (!profiled[i]) {
+			std::unique_lock<std::mutex> guard(times.lock);
+			++times.pending;
+			guard.unlock();
+			// Called on errors too. Without it, the time is taken at wait
+			if (events[i].setCallback(CL_COMPLETE, slice_completed,
+				&timers[i]) != CL_SUCCESS)
+			{
+				guard.lock();
+				--times.pending;
+			}
+		}
+		queue.flush();
+	}
+
+	// Rebalance the shares of the devices that took part, keeping their sum
+	{
+		std::unique_lock<std::mutex> guard(times.lock);
+		while (times.pending > 0)
+			times.completed.wait(guard);
+	}
+	double old_share = 0, rate_sum = 0;
+	std::vector<double> rates(slices.size());
+	for (size_t i = 0; i < slices.size(); ++i) {
+		// Errors are negative statuses, reported by wait
+		events[i].wait();
+		double t = times.seconds[i];
+		if (profiled[i])
+			t = 1e-9 * (events[i].getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+				events[i].getProfilingInfo<CL_PROFILING_COMMAND_START>());
+		else if (t < 0)
+			t = std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - times.start).count();
+		rates[i] = slices[i].size / std::max(t, 1e-9);
+		old_share += env.shares[slices[i].device];
+		rate_sum += rates[i];
+	}
+	if (slices.size() < 2)
+		return;
+	for (size_t i = 0; i < slices.size(); ++i) {
+		double &share = env.shares[slices[i].device];
+		// Smoothed, so a single noisy run does not swing the split
+		share = 0.5 * share + 0.5 * old_share * rates[i] / rate_sum;
+	}
+}
+
+// Device vector class
+
+template <typename T>
+DeviceVector<T>::DeviceVector(): count(0) {
+}
+
+template <typename T>
+DeviceVector<T>::DeviceVector(cl::Context &context, size_t n,
+	cl_mem_flags flags): count(n)
+{
+	// Buffers can not be empty
+	buf = create_buffer(context, flags, std::max(n, (size_t)1) * sizeof(T));
+}
+
+template <typename T>
+DeviceVector<T>::DeviceVector(DeviceVector &&other):
+	buf(other.buf), count(other.count)
+{
+	other.buf = cl::Buffer();
+	other.count = 0;
+}
+
+template <typename T>
+DeviceVector<T> &DeviceVector<T>::operator=(DeviceVector &&other) {
+	if (this != &other) {
+		buf = other.buf;
+		count = other.count;
+		other.buf = cl::Buffer();
+		other.count = 0;
+	}
+	return *this;
+}
+
+template <typename T>
+size_t DeviceVector<T>::size() const {
+	return count;
+}
+
+template <typename T>
+size_t DeviceVector<T>::bytes() const {
+	return count * sizeof(T);
+}
+
+template <typename T>
+cl::Buffer &DeviceVector<T>::buffer() {
+	return buf;
+}
+
+template <typename T>
+const cl::Buffer &DeviceVector<T>::buffer() const {
+	return buf;
+}
+
+template <typename T>
+cl::Event DeviceVector<T>::copy_from(cl::CommandQueue &queue, const T *src,
+	size_t n, size_t offset, const std::vector<cl::Event> &wait)
+{
+	// Checked before defaulting n, and without sums that could overflow
+	if (offset > count || n > count - offset)
+		throw OCHException("DeviceVector::copy_from() out of range",
+			CL_INVALID_VALUE);
+	if (n == 0)
+		n = count - offset;
+	return enqueue_write_buffer(queue, buf, offset * sizeof(T), n * sizeof(T),
+		src, wait);
+}
+
+template <typename T>
+cl::Event DeviceVector<T>::copy_to(cl::CommandQueue &queue, T *dst,
+	size_t n, size_t offset, const std::vector<cl::Event> &wait)
+{
+	// Checked before defaulting n, and without sums that could overflow
+	if (offset > count || n > count - offset)
+		throw OCHException("DeviceVector::copy_to() out of range",
+			CL_INVALID_VALUE);
+	if (n == 0)
+		n = count - offset;
+	return enqueue_read_buffer(queue, buf, offset * sizeof(T), n * sizeof(T),
+		dst, wait);
+}
+
+template <typename T>
+T *DeviceVector<T>::map(cl::CommandQueue &queue, const std::string &flags,
+	const std::vector<cl::Event> &wait)
+{
+	return (T *)map_buffer(queue, buf, flags, 0, bytes(), wait);
+}
+
+template <typename T>
+cl::Event DeviceVector<T>::unmap(cl::CommandQueue &queue, T *ptr,
+	const std::vector<cl::Event> &wait)
+{
+	return unmap_buffer(queue, buf, ptr, wait);
+}
+
+// Typed kernel class
+
+// Private implementation, do not use these
+// Compare the bytes identifying a kernel argument with the last ones in place,
+// and store them, with the buffer to hold, once the argument is set
+template <class Tp>
+bool kernel_arg_changed(const Tp &value, const std::string &last) {
+	static_assert(std::is_trivially_copyable<Tp>::value,
+		"kernel arguments must be buffers or plain data");
+	return last.compare(0, std::string::npos, (const char *)&value,
+		sizeof(value)) != 0;
+}
+
+bool kernel_arg_changed(const cl::Buffer &value, const std::string &last) {
+	cl_mem mem = value();
+	return last.compare(0, std::string::npos, (const char *)&mem,
+		sizeof(mem)) != 0;
+}
+
+template <class Tp>
+bool kernel_arg_changed(const DeviceVector<Tp> &value,
+	const std::string &last)
+{
+	return kernel_arg_changed(value.buffer(), last);
+}
+
+template <class Tp>
+void kernel_arg_store(const Tp &value, std::string &last, cl::Buffer &) {
+	last.assign((const char *)&value, sizeof(value));
+}
+
+void kernel_arg_store(const cl::Buffer &value, std::string &last,
+	cl::Buffer &held)
+{
+	cl_mem mem = value();
+	last.assign((const char *)&mem, sizeof(mem));
+	held = value;
+}
+
+template <class Tp>
+void kernel_arg_store(const DeviceVector<Tp> &value, std::string &last,
+	cl::Buffer &held)
+{
+	kernel_arg_store(value.buffer(), last, held);
+}
+
+template <typename... Args>
+OCHKernel<Args...>::OCHKernel(const cl::Kernel &k): kernel(k) {
+	if (kernel.getInfo<CL_KERNEL_NUM_ARGS>() != sizeof...(Args))
+		throw OCHException("OCHKernel::OCHKernel() wrong argument count: " +
+			kernel.getInfo<CL_KERNEL_FUNCTION_NAME>(), CL_INVALID_VALUE);
+}
+
+template <typename... Args>
+void OCHKernel<Args...>::update(cl_uint) {
+}
+
+template <typename... Args>
+template <class Tp, typename... Rest>
+void OCHKernel<Args...>::update(cl_uint pos, const Tp &value,
+	const Rest &... rest)
+{
+	// Unchanged arguments cost a compare, with no copies or retains
+	if (kernel_arg_changed(value, last[pos])) {
+		set_kernel_arg(kernel, pos, value);
+		kernel_arg_store(value, last[pos], held[pos]);
+	}
+	update(pos + 1, rest...);
+}
+
+template <typename... Args>
+cl::Event OCHKernel<Args...>::operator()(cl::CommandQueue &queue,
+	const cl::NDRange &global, const cl::NDRange &local, const Args &... args)
+{
+	update(0, args...);
+	return enqueue_nd_range_kernel(queue, kernel, cl::NullRange, global, local);
+}
+
+template <typename... Args>
+cl::Event OCHKernel<Args...>::launch(cl::CommandQueue &queue,
+	const cl::NDRange &global, const cl::NDRange &local,
+	const std::vector<cl::Event> &wait, const Args &... args)
+{
+	update(0, args...);
+	return enqueue_nd_range_kernel(queue, kernel, cl::NullRange, global, local,
+		wait);
+}
+
+template <typename... Args>
+OCHKernel<Args...> make_kernel(cl::Program &program,
+	const std::string &entry_point)
+{
+	return OCHKernel<Args...>(load_kernel(program, entry_point));
+}
+
+// Helpers for the kernels shipped along OCHell
+
+size_t vector_add_width(const cl::Device &device) {
+	size_t preferred = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT>();
+	size_t width = 16;
+	while (width > preferred && width > 4)
+		width /= 2;
+	return width <= preferred ? width : 1;
+}
+
+std::string vector_add_kernel_name(size_t width) {
+	if (width == 1)
+		return "vector_add";
+	return "vector_add" + std::to_string(width);
+}
+
+cl::NDRange vector_add_global(size_t width, size_t len,
+	size_t elems_per_item)
+{
+	if (width == 1)
+		return cl::NDRange(len);
+	// Vectors, the last one possibly partial
+	size_t vectors = (len + width - 1) / width;
+	return cl::NDRange((vectors + elems_per_item - 1) / elems_per_item);
+}
+
+// Private implementation, do not use this
+// Rows whose byte size is a multiple of the sub-buffer alignment of all the
+// devices of the environment
+size_t aligned_rows(OCHEnvironment &env, size_t row_bytes) {
+	size_t alignment = get_host_alignment(env.context);
+	size_t rows = 1;
+	while ((rows * row_bytes) % alignment != 0)
+		rows *= 2;
+	return rows;
+}
+
+void split_vector_add(OCHEnvironment &env, cl::Buffer &A, cl::Buffer &B,
+	cl::Buffer &C, size_t len)
+{
+	size_t granularity = aligned_rows(env, sizeof(cl_int));
+	// Sub-buffers must outlive the launches
+	std::vector<cl::Buffer> subs;
+	run_split_kernel(env, "vector_add", len, granularity,
+		[&](cl::Kernel &kernel, const OCHSlice &s) {
+			size_t offset = s.offset * sizeof(cl_int);
+			size_t size = s.size * sizeof(cl_int);
+			subs.push_back(create_sub_buffer(A, offset, size));
+			subs.push_back(create_sub_buffer(B, offset, size));
+			subs.push_back(create_sub_buffer(C, offset, size));
+			set_kernel_args(kernel, subs[subs.size() - 3],
+				subs[subs.size() - 2], subs.back(), (cl_int)s.size);
+			return cl::NDRange(s.size);
+		});
+}
+
+void split_square_matrix_multiply(OCHEnvironment &env, cl::Buffer &C,
+	cl::Buffer &A, cl::Buffer &B, size_t side)
+{
+	size_t row_bytes = side * sizeof(cl_int);
+	size_t granularity = aligned_rows(env, row_bytes);
+	// Sub-buffers must outlive the launches
+	std::vector<cl::Buffer> subs;
+	run_split_kernel(env, "square_matrix_multiply", side, granularity,
+		[&](cl::Kernel &kernel, const OCHSlice &s) {
+			size_t offset = s.offset * row_bytes;
+			size_t size = s.size * row_bytes;
+			subs.push_back(create_sub_buffer(C, offset, size));
+			subs.push_back(create_sub_buffer(A, offset, size));
+			set_kernel_args(kernel, subs[subs.size() - 2], subs.back(), B,
+				(cl_int)side);
+			return cl::NDRange(s.size, side);
+		});
+}
+
+// Private implementation, do not use these
+// Origin and region of a rows x cols block of ints, in bytes and rows
+void block_region(size_t rows, size_t cols, cl::size_t<3> &origin,
+	cl::size_t<3> &region)
+{
+	origin[0] = origin[1] = origin[2] = 0;
+	region[0] = cols * sizeof(cl_int);
+	region[1] = rows;
+	region[2] = 1;
+}
+
+// Enqueue the write of a rows x cols block of a host int matrix with pitch
+// elements per row, to a dense buffer
+cl::Event enqueue_block_write(cl::CommandQueue &queue, cl::Buffer &buffer,
+	const cl_int *host, size_t rows, size_t cols, size_t pitch,
+	const std::vector<cl::Event> &wait)
+{
+	cl::size_t<3> origin, region;
+	block_region(rows, cols, origin, region);
+	cl::Event event;
+	cl_int error = queue.enqueueWriteBufferRect(buffer, CL_FALSE, origin,
+		origin, region, region[0], 0, pitch * sizeof(cl_int), 0, host,
+		wait_list(wait), &event);
+	OCH_CHECK(error, "Queue::enqueueWriteBufferRect()");
+	if (OCH_PROFILING)
+		profiler().record("write_buffer", event);
+	return event;
+}
+
+// Same as enqueue_block_write, reading the block back from the buffer
+cl::Event enqueue_block_read(cl::CommandQueue &queue, cl::Buffer &buffer,
+	cl_int *host, size_t rows, size_t cols, size_t pitch,
+	const std::vector<cl::Event> &wait)
+{
+	cl::size_t<3> origin, region;
+	block_region(rows, cols, origin, region);
+	cl::Event event;
+	cl_int error = queue.enqueueReadBufferRect(buffer, CL_FALSE, origin,
+		origin, region, region[0], 0, pitch * sizeof(cl_int), 0, host,
+		wait_list(wait), &event);
+	OCH_CHECK(error, "Queue::enqueueReadBufferRect()");
+	if (OCH_PROFILING)
+		profiler().record("read_buffer", event);
+	return event;
+}
+
+void out_of_core_square_matrix_multiply(OCHEnvironment &env, cl_int *C,
+	const cl_int *A, const cl_int *B, size_t side, size_t budget,
+	size_t tile_size)
+{
+	cl::Device &device = env.devices[0];
+	// Two tiles of C and two panels each of A and B, all t x t, with t a
+	// multiple of the tile size, not larger than needed
+	size_t max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	if (tile_size == 0 ||
+		tile_size * tile_size * sizeof(cl_int) * 6 > budget ||
+		tile_size * tile_size * sizeof(cl_int) > max_alloc)
+		throw OCHException("out_of_core_square_matrix_multiply() tiles do not "
+			"fit the budget", CL_INVALID_VALUE);
+	size_t t = tile_size;
+	while ((t + tile_size) * (t + tile_size) * sizeof(cl_int) * 6 <= budget &&
+		(t + tile_size) * (t + tile_size) * sizeof(cl_int) <= max_alloc &&
+		t < side)
+		t += tile_size;
+	size_t block_bytes = t * t * sizeof(cl_int);
+	cl::Buffer tiles[2], panelsA[2], panelsB[2];
+	for (size_t i = 0; i < 2; ++i) {
+		tiles[i] = create_buffer(env.context, CL_MEM_READ_WRITE, block_bytes);
+		panelsA[i] = create_buffer(env.context, CL_MEM_READ_ONLY, block_bytes);
+		panelsB[i] = create_buffer(env.context, CL_MEM_READ_ONLY, block_bytes);
+	}
+	cl::CommandQueue upload = create_command_queue(env.context, device);
+	cl::CommandQueue compute = create_command_queue(env.context, device);
+	cl::CommandQueue download = create_command_queue(env.context, device);
+	cl::Kernel &kernel = env.kernel("tile_accumulate", "matrix_multiply.cl",
+		"-D TILE_SIZE=" + std::to_string(tile_size));
+	if (kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) <
+		tile_size * tile_size)
+		throw OCHException("out_of_core_square_matrix_multiply() tile size "
+			"too large for the kernel", CL_INVALID_WORK_GROUP_SIZE);
+
+	// Events of the launches on each panel and of the read of each tile
+	std::vector<cl::Event> launches, reads;
+	size_t panel = 0, tile = 0;
+	for (size_t bi = 0; bi < side; bi += t) {
+		for (size_t bj = 0; bj < side; bj += t, ++tile) {
+			size_t rows = std::min(t, side - bi);
+			size_t cols = std::min(t, side - bj);
+			cl::Buffer &Ct = tiles[tile % 2];
+			for (size_t bk = 0; bk < side; bk += t, ++panel) {
+				size_t inner = std::min(t, side - bk);
+				cl::Buffer &At = panelsA[panel % 2];
+				cl::Buffer &Bt = panelsB[panel % 2];
+				// Panels are free when the launch that used them completes
+				std::vector<cl::Event> wait;
+				if (panel >= 2)
+					wait.push_back(launches[panel - 2]);
+				enqueue_block_write(upload, At, A + bi * side + bk, rows, inner,
+					side, wait);
+				std::vector<cl::Event> ready(1, enqueue_block_write(upload, Bt,
+					B + bk * side + bj, inner, cols, side, wait));
+				// The tile is free when read back
+				if (bk == 0 && tile >= 2)
+					ready.push_back(reads[tile - 2]);
+				set_kernel_args(kernel, Ct, At, Bt, (cl_int)rows, (cl_int)cols,
+					(cl_int)inner, (cl_int)(bk == 0));
+				cl::NDRange global(
+					(cols + tile_size - 1) / tile_size * tile_size,
+					(rows + tile_size - 1) / tile_size * tile_size);
+				launches.push_back(enqueue_nd_range_kernel(compute, kernel,
+					cl::NullRange, global, cl::NDRange(tile_size, tile_size),
+					ready));
+				upload.flush();
+				compute.flush();
+			}
+			std::vector<cl::Event> wait(1, launches.back());
+			reads.push_back(enqueue_block_read(download, Ct,
+				C + bi * side + bj, rows, cols, side, wait));
+			download.flush();
+		}
+	}
+	// In-order queue: the last read completes after the others
+	if (!reads.empty())
+		reads.back().wait();
+}
+
+// Dispatcher
+
+OCHDispatcher::OCHDispatcher(cl_device_type type):
+	vector_add_threshold(1 << 20), matrix_threshold(128)
+{
+	// Failures throw, are left in last_error() or, without checks, show up
+	// as missing devices and kernels, depending on OCHELL_ERROR_MODE
+	OCHError saved = last_error();
+	last_error() = OCHError{ "", CL_SUCCESS };
+	try {
+		env.reset(new OCHEnvironment(type));
+		if (!env->devices.empty() && last_error().error == CL_SUCCESS) {
+			env->load_program("vector_add_kernel.cl");
+			env->load_program("matrix_multiply.cl");
+		}
+		if (env->devices.empty() || last_error().error != CL_SUCCESS)
+			env.reset();
+		else {
+			// Throw if not built
+			env->kernel(vector_add_kernel_name(
+				vector_add_width(env->devices[0])));
+			env->kernel("square_matrix_multiply");
+			env->kernel("tiled_square_matrix_multiply");
+		}
+	} catch (const OCHException &) {
+		env.reset();
+	}
+	if (last_error().error == CL_SUCCESS)
+		last_error() = saved;
+}
+
+bool OCHDispatcher::has_opencl() const {
+	return env.get() != 0;
+}
+
+void OCHDispatcher::vector_add(const cl_int *A, const cl_int *B, cl_int *C,
+	size_t len)
+{
+	if (!env || len < vector_add_threshold) {
+		native_vector_add(A, B, C, len);
+		return;
+	}
+	size_t bytes = len * sizeof(cl_int);
+	cl::Buffer a = create_buffer(env->context, OCH_MEM_FLAGS("rc"), bytes,
+		(void *)A);
+	cl::Buffer b = create_buffer(env->context, OCH_MEM_FLAGS("rc"), bytes,
+		(void *)B);
+	cl::Buffer c = create_buffer(env->context, OCH_MEM_FLAGS("w"), bytes);
+	size_t width = vector_add_width(env->devices[0]);
+	cl::Kernel &kernel = env->kernel(vector_add_kernel_name(width));
+	set_kernel_args(kernel, a, b, c, (cl_int)len);
+	std::vector<cl::Event> wait(1, enqueue_nd_range_kernel(env->queue(),
+		kernel, cl::NullRange, vector_add_global(width, len), cl::NullRange));
+	enqueue_read_buffer(env->queue(), c, 0, bytes, C, wait).wait();
+}
+
+void OCHDispatcher::square_matrix_multiply(cl_int *C, const cl_int *A,
+	const cl_int *B, size_t side)
+{
+	if (!env || side < matrix_threshold) {
+		native_square_matrix_multiply(C, A, B, side);
+		return;
+	}
+	size_t bytes = side * side * sizeof(cl_int);
+	cl::Buffer a = create_buffer(env->context, OCH_MEM_FLAGS("rc"), bytes,
+		(void *)A);
+	cl::Buffer b = create_buffer(env->context, OCH_MEM_FLAGS("rc"), bytes,
+		(void *)B);
+	cl::Buffer c = create_buffer(env->context, OCH_MEM_FLAGS("rw"), bytes);
+	// Tiled kernel with the default TILE_SIZE, if the kernel allows groups
+	// that large
+	const size_t tile = 16;
+	std::vector<cl::Event> wait;
+	cl::Kernel &tiled = env->kernel("tiled_square_matrix_multiply");
+	if (tiled.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(env->devices[0]) >=
+		tile * tile)
+	{
+		set_kernel_args(tiled, c, a, b, (cl_int)side);
+		size_t global = (side + tile - 1) / tile * tile;
+		wait.push_back(enqueue_nd_range_kernel(env->queue(), tiled,
+			cl::NullRange, cl::NDRange(global, global),
+			cl::NDRange(tile, tile)));
+	} else {
+		// The naive kernel adds into C, which must start at zero as the
+		// native version overwrites it
+		std::vector<cl_int> zeros(side * side, 0);
+		blocking_write_buffer(env->queue(), c, 0, bytes, &zeros[0]);
+		cl::Kernel &kernel = env->kernel("square_matrix_multiply");
+		set_kernel_args(kernel, c, a, b, (cl_int)side);
+		wait.push_back(enqueue_nd_range_kernel(env->queue(), kernel,
+			cl::NullRange, cl::NDRange(side, side), cl::NullRange));
+	}
+	enqueue_read_buffer(env->queue(), c, 0, bytes, C, wait).wait();
+}
+
+void stream_vector_add(OCHEnvironment &env, OCHStream &stream, const cl_int *A,
+	const cl_int *B, cl_int *C, size_t len)
+{
+	size_t width = vector_add_width(stream.device);
+	cl::Kernel &kernel = env.kernel(vector_add_kernel_name(width));
+	std::vector<std::pair<const void *, size_t> > inputs;
+	inputs.push_back(std::make_pair((const void *)A, sizeof(cl_int)));
+	inputs.push_back(std::make_pair((const void *)B, sizeof(cl_int)));
+	std::vector<std::pair<void *, size_t> > outputs;
+	outputs.push_back(std::make_pair((void *)C, sizeof(cl_int)));
+	stream.run(kernel, len, inputs, outputs,
+		[&](cl::Kernel &k, std::vector<cl::Buffer> &b, size_t n) {
+			set_kernel_args(k, b[0], b[1], b[2], (cl_int)n);
+			return vector_add_global(width, n);
+		});
+}
+
+// Private implementation, do not use these
+// Local size of the kernels of the primitives: the largest power of two up
+// to 256 supported by the device, and by the kernel if given
+size_t primitive_work_group_size(const cl::Device &device) {
+	size_t wg = 256;
+	while (wg > device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>())
+		wg /= 2;
+	return wg;
+}
+
+size_t primitive_work_group_size(const cl::Device &device,
+	const cl::Kernel &kernel)
+{
+	size_t wg = primitive_work_group_size(device);
+	while (wg > kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device))
+		wg /= 2;
+	return wg;
+}
+
+// Same, for kernels whose options set their WG_SIZE (reduce.cl, scan.cl).
+// Their local arrays and registers grow with it, so they are rebuilt smaller
+// while any of them supports less than it was built for
+size_t primitive_work_group_size(OCHEnvironment &env, size_t device,
+	const std::string &path, const std::vector<std::string> &names,
+	const std::function<std::string(size_t)> &options)
+{
+	cl::Device &dev = env.devices.at(device);
+	size_t wg = primitive_work_group_size(dev);
+	for (;;) {
+		size_t supported = wg;
+		for (size_t i = 0; i < names.size(); ++i)
+			supported = std::min(supported, primitive_work_group_size(dev,
+				env.kernel(names[i], path, options(wg))));
+		if (supported == wg)
+			return wg;
+		wg = supported;
+	}
+}
+
+// Build options of reduce.cl for type T
+template <typename T>
+std::string reduce_options(const std::string &op, const std::string &identity,
+	size_t wg)
+{
+	return std::string("-D T=") + OCHTypeName<T>::name() + " -D OP(a,b)=" +
+		op + " -D IDENTITY=" + identity + " -D WG_SIZE=" + std::to_string(wg);
+}
+
+template <typename T>
+T reduce(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	const std::string &op, const std::string &identity, size_t device)
+{
+	std::function<std::string(size_t)> options = [&](size_t wg) {
+		return reduce_options<T>(op, identity, wg);
+	};
+	size_t wg = primitive_work_group_size(env, device, "reduce.cl",
+		std::vector<std::string>(1, "reduce"), options);
+	cl::Kernel &kernel = env.kernel("reduce", "reduce.cl", options(wg));
+	// No more partial results than the second pass reduces in one group
+	size_t groups = std::max((size_t)1, std::min(wg, (n + wg - 1) / wg));
+	cl::Buffer partial = create_buffer(env.context, CL_MEM_READ_WRITE,
+		groups * sizeof(T));
+	cl::CommandQueue &queue = env.queue(device);
+	set_kernel_args(kernel, in, partial, (cl_ulong)n);
+	enqueue_nd_range_kernel(queue, kernel, cl::NullRange,
+		cl::NDRange(groups * wg), cl::NDRange(wg));
+	// In place: the group reads all the partial results before writing
+	set_kernel_args(kernel, partial, partial, (cl_ulong)groups);
+	enqueue_nd_range_kernel(queue, kernel, cl::NullRange, cl::NDRange(wg),
+		cl::NDRange(wg));
+	T result;
+	blocking_read_buffer(queue, partial, 0, sizeof(T), &result);
+	return result;
+}
+
+template <typename T>
+T reduce_sum(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	size_t device)
+{
+	return reduce<T>(env, in, n, "((a)+(b))", "0", device);
+}
+
+template <typename T>
+T reduce_min(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	size_t device)
+{
+	return reduce<T>(env, in, n, "min(a,b)", OCHTypeName<T>::highest(),
+		device);
+}
+
+template <typename T>
+T reduce_max(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	size_t device)
+{
+	return reduce<T>(env, in, n, "max(a,b)", OCHTypeName<T>::lowest(),
+		device);
+}
+
+template <typename T>
+size_t reduce_argmax(OCHEnvironment &env, const cl::Buffer &in, size_t n,
+	size_t device)
+{
+	std::function<std::string(size_t)> options = [](size_t wg) {
+		return reduce_options<T>("max(a,b)", OCHTypeName<T>::lowest(), wg);
+	};
+	size_t wg = primitive_work_group_size(env, device, "reduce.cl",
+		std::vector<std::string>(1, "reduce_arg"), options);
+	cl::Kernel &kernel = env.kernel("reduce_arg", "reduce.cl", options(wg));
+	size_t groups = std::max((size_t)1, std::min(wg, (n + wg - 1) / wg));
+	cl::Buffer values = create_buffer(env.context, CL_MEM_READ_WRITE,
+		groups * sizeof(T));
+	cl::Buffer indices = create_buffer(env.context, CL_MEM_READ_WRITE,
+		groups * sizeof(cl_ulong));
+	cl::CommandQueue &queue = env.queue(device);
+	// Input indices are not read on the first pass
+	set_kernel_args(kernel, in, indices, values, indices, (cl_ulong)n,
+		(cl_int)1);
+	enqueue_nd_range_kernel(queue, kernel, cl::NullRange,
+		cl::NDRange(groups * wg), cl::NDRange(wg));
+	set_kernel_args(kernel, values, indices, values, indices,
+		(cl_ulong)groups, (cl_int)0);
+	enqueue_nd_range_kernel(queue, kernel, cl::NullRange, cl::NDRange(wg),
+		cl::NDRange(wg));
+	cl_ulong index;
+	blocking_read_buffer(queue, indices, 0, sizeof(index), &index);
+	return index;
+}
+
+template <typename T>
+T reduce_sum(OCHEnvironment &env, const DeviceVector<T> &in, size_t device) {
+	return reduce_sum<T>(env, in.buffer(), in.size(), device);
+}
+
+template <typename T>
+T reduce_min(OCHEnvironment &env, const DeviceVector<T> &in, size_t device) {
+	return reduce_min<T>(env, in.buffer(), in.size(), device);
+}
+
+template <typename T>
+T reduce_max(OCHEnvironment &env, const DeviceVector<T> &in, size_t device) {
+	return reduce_max<T>(env, in.buffer(), in.size(), device);
+}
+
+template <typename T>
+size_t reduce_argmax(OCHEnvironment &env, const DeviceVector<T> &in,
+	size_t device)
+{
+	return reduce_argmax<T>(env, in.buffer(), in.size(), device);
+}
+
+// Private implementation, do not use these
+// Elements scanned by each work-item of scan.cl
+const size_t scan_items = 8;
+
+// Build options of scan.cl for type T
+template <typename T>
+std::string scan_options(size_t wg) {
+	return std::string("-D T=") + OCHTypeName<T>::name() + " -D WG_SIZE=" +
+		std::to_string(wg) + " -D ITEMS=" + std::to_string(scan_items);
+}
+
+// Local size of scan.cl for type T on the device
+template <typename T>
+size_t scan_work_group_size(OCHEnvironment &env, size_t device) {
+	std::vector<std::string> names;
+	names.push_back("scan_blocks");
+	names.push_back("scan_add");
+	return primitive_work_group_size(env, device, "scan.cl", names,
+		scan_options<T>);
+}
+
+// Scan the blocks of n elements, then the block totals with another level,
+// and add them back to the blocks
+template <typename T>
+cl::Event scan_level(OCHEnvironment &env, cl::CommandQueue &queue,
+	const cl::Buffer &in, cl::Buffer &out, size_t n, bool inclusive,
+	size_t wg)
+{
+	std::string options = scan_options<T>(wg);
+	size_t block = wg * scan_items;
+	size_t groups = std::max((size_t)1, (n + block - 1) / block);
+	cl::NDRange global(groups * wg), local(wg);
+	cl::Buffer sums = create_buffer(env.context, CL_MEM_READ_WRITE,
+		groups * sizeof(T));
+	cl::Kernel &blocks = env.kernel("scan_blocks", "scan.cl", options);
+	set_kernel_args(blocks, in, out, sums, (cl_ulong)n, (cl_int)inclusive);
+	cl::Event event = enqueue_nd_range_kernel(queue, blocks, cl::NullRange,
+		global, local);
+	if (groups == 1)
+		return event;
+	scan_level<T>(env, queue, sums, sums, groups, false, wg);
+	cl::Kernel &add = env.kernel("scan_add", "scan.cl", options);
+	set_kernel_args(add, out, sums, (cl_ulong)n);
+	return enqueue_nd_range_kernel(queue, add, cl::NullRange, global, local);
+}
+
+template <typename T>
+cl::Event inclusive_scan(OCHEnvironment &env, const cl::Buffer &in,
+	cl::Buffer &out, size_t n, size_t device)
+{
+	return scan_level<T>(env, env.queue(device), in, out, n, true,
+		scan_work_group_size<T>(env, device));
+}
+
+template <typename T>
+cl::Event exclusive_scan(OCHEnvironment &env, const cl::Buffer &in,
+	cl::Buffer &out, size_t n, size_t device)
+{
+	return scan_level<T>(env, env.queue(device), in, out, n, false,
+		scan_work_group_size<T>(env, device));
+}
+
+template <typename T>
+cl::Event inclusive_scan(OCHEnvironment &env, const DeviceVector<T> &in,
+	DeviceVector<T> &out, size_t device)
+{
+	return inclusive_scan<T>(env, in.buffer(), out.buffer(), in.size(), device);
+}
+
+template <typename T>
+cl::Event exclusive_scan(OCHEnvironment &env, const DeviceVector<T> &in,
+	DeviceVector<T> &out, size_t device)
+{
+	return exclusive_scan<T>(env, in.buffer(), out.buffer(), in.size(), device);
+}
+
+// Private implementation, do not use these
+// Bits of the digits sorted by each pass of radix_sort.cl
+const size_t radix_bits = 8;
+
+// Build options of radix_sort.cl for keys K and values V
+template <typename K, typename V>
+std::string radix_sort_options() {
+	static_assert(std::is_integral<K>::value &&
+		(sizeof(K) == 4 || sizeof(K) == 8),
+		"radix sort keys must be 32 or 64 bit integers");
+	// Signed keys are sorted as unsigned, with the sign bit flipped
+	const char *flip = !std::is_signed<K>::value ? "0" :
+		sizeof(K) == 4 ? "0x80000000u" : "0x8000000000000000ul";
+	return std::string("-D K=") + OCHTypeName<K>::name() + " -D V=" +
+		OCHTypeName<V>::name() + " -D FLIP=" + flip + " -D RADIX_BITS=" +
+		std::to_string(radix_bits);
+}
+
+// Sort the keys, and the values too if not null
+template <typename K, typename V>
+cl::Event radix_sort(OCHEnvironment &env, cl::Buffer &keys, cl::Buffer *values,
+	size_t n, size_t device)
+{
+	std::string options = radix_sort_options<K, V>();
+	cl::Device &dev = env.devices.at(device);
+	cl::CommandQueue &queue = env.queue(device);
+	cl::Kernel &count = env.kernel("radix_count", "radix_sort.cl", options);
+	cl::Kernel &scatter = env.kernel(values ? "radix_scatter_pairs" :
+		"radix_scatter", "radix_sort.cl", options);
+	size_t wg = std::min(primitive_work_group_size(dev, count),
+		primitive_work_group_size(dev, scatter));
+	// Enough work-items to fill the device, with chunks of at least a few
+	// hundred elements, in whole groups
+	size_t items = std::min(dev.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * wg,
+		(n + 255) / 256);
+	items = std::max((size_t)1, (items + wg - 1) / wg) * wg;
+	size_t counts_size = ((size_t)1 << radix_bits) * items;
+	cl::Buffer counts = create_buffer(env.context, CL_MEM_READ_WRITE,
+		counts_size * sizeof(cl_uint));
+	// Buffers can not be empty
+	cl::Buffer tmp_keys = create_buffer(env.context, CL_MEM_READ_WRITE,
+		std::max(n, (size_t)1) * sizeof(K));
+	cl::Buffer tmp_values;
+	if (values)
+		tmp_values = create_buffer(env.context, CL_MEM_READ_WRITE,
+			std::max(n, (size_t)1) * sizeof(V));
+
+	cl::Buffer *src = &keys, *dst = &tmp_keys;
+	cl::Buffer *src_values = values, *dst_values = &tmp_values;
+	cl::Event event;
+	for (cl_uint shift = 0; shift < sizeof(K) * 8; shift += radix_bits) {
+		set_kernel_args(count, *src, counts, (cl_ulong)n, shift);
+		enqueue_nd_range_kernel(queue, count, cl::NullRange,
+			cl::NDRange(items), cl::NDRange(wg));
+		exclusive_scan<cl_uint>(env, counts, counts, counts_size, device);
+		if (values)
+			set_kernel_args(scatter, *src, *dst, *src_values, *dst_values,
+				counts, (cl_ulong)n, shift);
+		else
+			set_kernel_args(scatter, *src, *dst, counts, (cl_ulong)n, shift);
+		event = enqueue_nd_range_kernel(queue, scatter, cl::NullRange,
+			cl::NDRange(items), cl::NDRange(wg));
+		std::swap(src, dst);
+		std::swap(src_values, dst_values);
+	}
+	// The number of passes is even, so the result is back in keys
+	return event;
+}
+
+template <typename K>
+cl::Event sort(OCHEnvironment &env, cl::Buffer &keys, size_t n,
+	size_t device)
+{
+	return radix_sort<K, cl_uint>(env, keys, 0, n, device);
+}
+
+template <typename K, typename V>
+cl::Event sort(OCHEnvironment &env, cl::Buffer &keys, cl::Buffer &values,
+	size_t n, size_t device)
+{
+	return radix_sort<K, V>(env, keys, &values, n, device);
+}
+
+template <typename K>
+cl::Event sort(OCHEnvironment &env, DeviceVector<K> &keys, size_t device) {
+	return sort<K>(env, keys.buffer(), keys.size(), device);
+}
+
+template <typename K, typename V>
+cl::Event sort(OCHEnvironment &env, DeviceVector<K> &keys,
+	DeviceVector<V> &values, size_t device)
+{
+	return sort<K, V>(env, keys.buffer(), values.buffer(), keys.size(),
+		device);
+}
+
+template <typename T>
+size_t compact(OCHEnvironment &env, const cl::Buffer &in, cl::Buffer &out,
+	size_t n, const std::string &predicate, T arg, size_t device)
+{
+	if (n == 0)
+		return 0;
+	std::string options = std::string("-D T=") + OCHTypeName<T>::name() +
+		" -D PREDICATE(x,arg)=(" + predicate + ")";
+	cl::CommandQueue &queue = env.queue(device);
+	cl::Buffer positions = create_buffer(env.context, CL_MEM_READ_WRITE,
+		n * sizeof(cl_uint));
+	cl::Buffer count = create_buffer(env.context, CL_MEM_WRITE_ONLY,
+		sizeof(cl_uint));
+
+	cl::Kernel &flags = env.kernel("compact_flags", "compact.cl", options);
+	set_kernel_args(flags, in, positions, (cl_ulong)n, arg);
+	enqueue_nd_range_kernel(queue, flags, cl::NullRange, cl::NDRange(n),
+		cl::NullRange);
+	exclusive_scan<cl_uint>(env, positions, positions, n, device);
+	cl::Kernel &scatter = env.kernel("compact_scatter", "compact.cl", options);
+	set_kernel_args(scatter, in, positions, out, count, (cl_ulong)n, arg);
+	enqueue_nd_range_kernel(queue, scatter, cl::NullRange, cl::NDRange(n),
+		cl::NullRange);
+	cl_uint survivors;
+	blocking_read_buffer(queue, count, 0, sizeof(survivors), &survivors);
+	return survivors;
+}
+
+template <typename T>
+size_t compact(OCHEnvironment &env, const DeviceVector<T> &in,
+	DeviceVector<T> &out, const std::string &predicate, T arg, size_t device)
+{
+	return compact<T>(env, in.buffer(), out.buffer(), in.size(), predicate,
+		arg, device);
+}
+
+template <typename T>
+std::vector<T> compact_to_host(OCHEnvironment &env, const cl::Buffer &in,
+	size_t n, const std::string &predicate, T arg, size_t device)
+{
+	cl::Buffer out = create_buffer(env.context, CL_MEM_READ_WRITE,
+		std::max(n, (size_t)1) * sizeof(T));
+	std::vector<T> survivors(compact<T>(env, in, out, n, predicate, arg,
+		device));
+	if (!survivors.empty())
+		blocking_read_buffer(env.queue(device), out, 0,
+			survivors.size() * sizeof(T), &survivors[0]);
+	return survivors;
+}
+
+template <typename T>
+std::vector<cl_uint> histogram(OCHEnvironment &env, const cl::Buffer &in,
+	size_t n, size_t bins, T lo, T hi, size_t device)
+{
+	cl::Device &dev = env.devices.at(device);
+	// Also rejects NaN bounds
+	if (!(lo < hi))
+		throw OCHException("histogram() empty range", CL_INVALID_VALUE);
+	if (bins == 0 ||
+		bins * sizeof(cl_uint) > dev.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>())
+		throw OCHException("histogram() bins do not fit in local memory",
+			CL_INVALID_VALUE);
+	std::string options = std::string("-D T=") + OCHTypeName<T>::name() +
+		" -D INTEGRAL=" + (std::is_integral<T>::value ? "1" : "0") +
+		" -D NUM_BINS=" + std::to_string(bins);
+	cl::Kernel &kernel = env.kernel("histogram", "histogram.cl", options);
+	std::vector<cl_uint> counts(bins, 0);
+	cl::Buffer counts_buffer = create_buffer(env.context,
+		OCH_MEM_FLAGS("rwc"), bins * sizeof(cl_uint), &counts[0]);
+	// A few groups per compute unit, each counting many elements in its bins
+	size_t wg = primitive_work_group_size(dev, kernel);
+	size_t groups = std::max((size_t)1, std::min(
+		(size_t)dev.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4,
+		(n + wg - 1) / wg));
+	set_kernel_args(kernel, in, counts_buffer, (cl_ulong)n, lo, hi);
+	cl::CommandQueue &queue = env.queue(device);
+	enqueue_nd_range_kernel(queue, kernel, cl::NullRange,
+		cl::NDRange(groups * wg), cl::NDRange(wg));
+	blocking_read_buffer(queue, counts_buffer, 0, bins * sizeof(cl_uint),
+		&counts[0]);
+	return counts;
+}
+
+template <typename T>
+std::vector<cl_uint> histogram(OCHEnvironment &env, const DeviceVector<T> &in,
+	size_t bins, T lo, T hi, size_t device)
+{
+	return histogram<T>(env, in.buffer(), in.size(), bins, lo, hi, device);
+}
+
 
 
+#ifdef OCHELL_EMBED_KERNELS
+	#include "ochell_kernels.hh"
+#endif
+
 #endif /* __OCHELL_H__ */
 
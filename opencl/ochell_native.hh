@@ -0,0 +1,238 @@
+#ifndef __OCHELL_NATIVE_H__
+#define __OCHELL_NATIVE_H__
+
+/////////////////////////////////
+//  Native backend for OCHell  //
+// by  Alessandro "AkiRoss" Re //
+/////////////////////////////////
+
+/* Host implementations of the kernels shipped along OCHell, with the same
+arguments, usable without OpenCL and as reference for the kernels.
+
+Feature:
+ - No OpenCL dependency
+ - AVX-512 or AVX2 when enabled at compile time (e.g. -march=native), scalar
+   code otherwise
+ - Multithreaded on a shared thread pool, serial on small problems
+*/
+
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#if defined(__AVX512F__) || defined(__AVX2__)
+	#include <immintrin.h>
+#endif
+
+// Fixed set of threads running ranges of a loop. Thread-safe
+class OCHThreadPool {
+public:
+	// Start the given number of threads, by default one per hardware thread
+	OCHThreadPool(size_t threads = std::thread::hardware_concurrency());
+	~OCHThreadPool();
+	OCHThreadPool(const OCHThreadPool &) = delete;
+	OCHThreadPool &operator=(const OCHThreadPool &) = delete;
+	// Split [0, n) in ranges of at least grain indices, call body(begin, end)
+	// on each of them from the threads, and wait for all of them
+	void run(size_t n, size_t grain,
+		const std::function<void(size_t, size_t)> &body);
+	size_t size() const;
+
+private:
+	void work();
+	std::vector<std::thread> threads;
+	std::vector<std::function<void()> > tasks;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stop;
+};
+
+// Get the thread pool used by the native functions
+OCHThreadPool &native_thread_pool();
+
+// Name of the instruction set used: "avx512", "avx2" or "scalar"
+const char *native_isa();
+
+// C = A + B on len ints, as vector_add
+void native_vector_add(const int *A, const int *B, int *C, size_t len);
+
+// C = A B on side x side row-major int matrices, as square_matrix_multiply
+void native_square_matrix_multiply(int *C, const int *A, const int *B,
+	size_t side);
+
+///////////////////////////////////////////////////////////////////////////////
+////////////////////////////// Implementation /////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+// Thread pool
+
+OCHThreadPool::OCHThreadPool(size_t count): stop(false) {
+	for (size_t i = 0; i < std::max(count, (size_t)1); ++i)
+		threads.push_back(std::thread(&OCHThreadPool::work, this));
+}
+
+OCHThreadPool::~OCHThreadPool() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stop = true;
+	}
+	wake.notify_all();
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+size_t OCHThreadPool::size() const {
+	return threads.size();
+}
+
+void OCHThreadPool::work() {
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			while (!stop && tasks.empty())
+				wake.wait(guard);
+			if (tasks.empty())
+				return;
+			task = std::move(tasks.back());
+			tasks.pop_back();
+		}
+		task();
+	}
+}
+
+void OCHThreadPool::run(size_t n, size_t grain,
+	const std::function<void(size_t, size_t)> &body)
+{
+	size_t ranges = std::min(threads.size(),
+		(n + std::max(grain, (size_t)1) - 1) / std::max(grain, (size_t)1));
+	if (ranges <= 1) {
+		if (n > 0)
+			body(0, n);
+		return;
+	}
+	std::mutex done_lock;
+	std::condition_variable done;
+	size_t pending = ranges;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		for (size_t r = 0; r < ranges; ++r) {
+			size_t begin = n * r / ranges, end = n * (r + 1) / ranges;
+			tasks.push_back([&, begin, end] {
+				body(begin, end);
+				std::lock_guard<std::mutex> g(done_lock);
+				if (--pending == 0)
+					done.notify_one();
+			});
+		}
+	}
+	wake.notify_all();
+	std::unique_lock<std::mutex> guard(done_lock);
+	while (pending > 0)
+		done.wait(guard);
+}
+
+OCHThreadPool &native_thread_pool() {
+	static OCHThreadPool pool;
+	return pool;
+}
+
+const char *native_isa() {
+#if defined(__AVX512F__)
+	return "avx512";
+#elif defined(__AVX2__)
+	return "avx2";
+#else
+	return "scalar";
+#endif
+}
+
+// Kernels
+
+// Private implementation, do not use these
+// C[i] = A[i] + B[i] for i in [begin, end)
+void native_add_range(const int *A, const int *B, int *C, size_t begin,
+	size_t end)
+{
+	size_t i = begin;
+#if defined(__AVX512F__)
+	for (; i + 16 <= end; i += 16) {
+		__m512i a = _mm512_loadu_si512((const void *)(A + i));
+		__m512i b = _mm512_loadu_si512((const void *)(B + i));
+		_mm512_storeu_si512((void *)(C + i), _mm512_add_epi32(a, b));
+	}
+#elif defined(__AVX2__)
+	for (; i + 8 <= end; i += 8) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(A + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(B + i));
+		_mm256_storeu_si256((__m256i *)(C + i), _mm256_add_epi32(a, b));
+	}
+#endif
+	for (; i < end; ++i)
+		C[i] = A[i] + B[i];
+}
+
+// C[j] += a * B[j] for j in [0, n)
+void native_axpy(int *C, int a, const int *B, size_t n) {
+	size_t j = 0;
+#if defined(__AVX512F__)
+	__m512i va = _mm512_set1_epi32(a);
+	for (; j + 16 <= n; j += 16) {
+		__m512i b = _mm512_loadu_si512((const void *)(B + j));
+		__m512i c = _mm512_loadu_si512((const void *)(C + j));
+		c = _mm512_add_epi32(c, _mm512_mullo_epi32(va, b));
+		_mm512_storeu_si512((void *)(C + j), c);
+	}
+#elif defined(__AVX2__)
+	__m256i va = _mm256_set1_epi32(a);
+	for (; j + 8 <= n; j += 8) {
+		__m256i b = _mm256_loadu_si256((const __m256i *)(B + j));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(C + j));
+		c = _mm256_add_epi32(c, _mm256_mullo_epi32(va, b));
+		_mm256_storeu_si256((__m256i *)(C + j), c);
+	}
+#endif
+	for (; j < n; ++j)
+		C[j] += a * B[j];
+}
+
+// Rows [begin, end) of C = A B, in blocks of B that stay in cache
+void native_multiply_rows(int *C, const int *A, const int *B, size_t side,
+	size_t begin, size_t end)
+{
+	const size_t cols_block = 512, inner_block = 128;
+	for (size_t i = begin; i < end; ++i)
+		std::memset(C + i * side, 0, side * sizeof(int));
+	for (size_t j = 0; j < side; j += cols_block) {
+		size_t cols = std::min(cols_block, side - j);
+		for (size_t k0 = 0; k0 < side; k0 += inner_block) {
+			size_t k1 = std::min(k0 + inner_block, side);
+			for (size_t i = begin; i < end; ++i)
+				for (size_t k = k0; k < k1; ++k)
+					native_axpy(C + i * side + j, A[i * side + k],
+						B + k * side + j, cols);
+		}
+	}
+}
+
+void native_vector_add(const int *A, const int *B, int *C, size_t len) {
+	native_thread_pool().run(len, 1 << 16, [=](size_t begin, size_t end) {
+		native_add_range(A, B, C, begin, end);
+	});
+}
+
+void native_square_matrix_multiply(int *C, const int *A, const int *B,
+	size_t side)
+{
+	// About 2^18 multiply-adds per range at least
+	size_t grain = std::max((size_t)1, ((size_t)1 << 18) / (side * side + 1));
+	native_thread_pool().run(side, grain, [=](size_t begin, size_t end) {
+		native_multiply_rows(C, A, B, side, begin, end);
+	});
+}
+
+#endif /* __OCHELL_NATIVE_H__ */
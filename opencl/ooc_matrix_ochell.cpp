@@ -0,0 +1,51 @@
+// Compiled with
+// g++ -std=c++11 -O2 ooc_matrix_ochell.cpp -o ooc_matrix_ochell -l OpenCL && ./ooc_matrix_ochell
+// Usage: ./ooc_matrix_ochell [side (8192)] [device budget in MiB (256)]
+// Multiplies matrices that need not fit in device memory, with a bounded
+// device working set, and checks some elements of the result on the host.
+// Three side x side int matrices take 12 * side * side bytes of host memory
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+
+#include "ochell.hh"
+
+int main(int argc, char **argv) {
+	size_t side = argc > 1 ? std::atol(argv[1]) : 8192;
+	size_t budget = (argc > 2 ? std::atol(argv[2]) : 256) << 20;
+	size_t bsize = side * side * sizeof(cl_int);
+
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+	cl_int *A = (cl_int *)aligned_host_alloc(env.context, bsize);
+	cl_int *B = (cl_int *)aligned_host_alloc(env.context, bsize);
+	cl_int *C = (cl_int *)aligned_host_alloc(env.context, bsize);
+	for (size_t i = 0; i < side * side; ++i) {
+		A[i] = i % 7 - 3;
+		B[i] = i % 5 - 2;
+	}
+
+	std::chrono::steady_clock::time_point start =
+		std::chrono::steady_clock::now();
+	out_of_core_square_matrix_multiply(env, C, A, B, side, budget);
+	double seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - start).count();
+	std::cout << side << "x" << side << " with " << (budget >> 20) << " MiB: "
+		<< seconds << " s, " << 2.0 * side * side * side / seconds * 1e-9
+		<< " GFLOP/s" << std::endl;
+
+	bool ok = true;
+	for (size_t s = 0; s < 64 && ok; ++s) {
+		size_t row = std::rand() % side, col = std::rand() % side;
+		cl_int expected = 0;
+		for (size_t i = 0; i < side; ++i)
+			expected += A[row * side + i] * B[i * side + col];
+		ok = C[row * side + col] == expected;
+	}
+	std::cout << "check: " << (ok ? "ok" : "FAILED") << std::endl;
+
+	aligned_host_free(A);
+	aligned_host_free(B);
+	aligned_host_free(C);
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,59 @@
+// Compiled with
+// g++ -std=c++11 partition_ochell.cpp -o partition_ochell -l OpenCL -pthread && ./partition_ochell
+// Usage: ./partition_ochell [compute units per partition]
+// Splits the first CPU device by NUMA node (or in partitions of the given
+// number of compute units) and runs independent vector_add jobs on them,
+// one thread and one partition for each job
+
+#include <iostream>
+#include <cstdlib>
+#include <thread>
+
+#include "ochell.hh"
+
+void job(OCHEnvironment &env, int id, int len) {
+	size_t bsize = len * sizeof(int);
+	size_t device = env.next_device();
+	cl::CommandQueue &queue = env.queue(device);
+	// Kernel objects hold arguments, so each thread needs its own
+	cl::Kernel kern = env.new_kernel("vector_add");
+
+	std::vector<int> A(len, id), B(len, 1000), C(len);
+	cl::Buffer inA = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+	cl::Buffer inB = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+	cl::Buffer outC = create_buffer(env.context, OCH_MEM_FLAGS("w"), bsize);
+	set_kernel_args(kern, inA, inB, outC, len);
+	std::vector<cl::Event> uploads;
+	uploads.push_back(enqueue_write_buffer(queue, inA, 0, bsize, &A[0]));
+	uploads.push_back(enqueue_write_buffer(queue, inB, 0, bsize, &B[0]));
+	std::vector<cl::Event> launch(1, enqueue_nd_range_kernel(queue, kern,
+		cl::NullRange, cl::NDRange(len), cl::NullRange, uploads));
+	enqueue_read_buffer(queue, outC, 0, bsize, &C[0], launch).wait();
+
+	bool ok = true;
+	for (int i = 0; i < len; ++i)
+		ok = ok && C[i] == id + 1000;
+	std::cout << "INFO: job " << id << " on partition " << device
+		<< (ok ? " ok\n" : " FAILED\n");
+}
+
+int main(int argc, char **argv) {
+	size_t units = argc > 1 ? std::atoi(argv[1]) : 0;
+	std::vector<cl::Platform> platforms = get_platforms();
+	cl::Device cpu = get_devices(platforms.at(0), CL_DEVICE_TYPE_CPU).at(0);
+	std::vector<cl::Device> parts = units > 0 ?
+		partition_device(cpu, OCH_PARTITION_EQUALLY, units) :
+		partition_device(cpu, OCH_PARTITION_NUMA);
+	std::cout << "INFO: " << parts.size() << " partitions\n";
+
+	OCHEnvironment env(parts);
+	env.load_program("vector_add_kernel.cl");
+
+	std::vector<std::thread> jobs;
+	for (size_t i = 0; i < 2 * parts.size(); ++i)
+		jobs.push_back(std::thread(job, std::ref(env), (int)i, 1 << 20));
+	for (size_t i = 0; i < jobs.size(); ++i)
+		jobs[i].join();
+
+	exit(EXIT_SUCCESS);
+}
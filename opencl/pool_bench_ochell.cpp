@@ -0,0 +1,89 @@
+// Compiled with
+// g++ -std=c++11 -O2 pool_bench_ochell.cpp -o pool_bench -l OpenCL
+// Usage: ./pool_bench [iterations (10000)]
+// Host time of vector_add steps of varying sizes, with buffers created for
+// each step or taken from an OCHBufferPool, and the number of buffers the
+// pool created during warm-up and after it
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+
+#include "ochell.hh"
+
+typedef std::chrono::steady_clock Clock;
+
+double seconds(Clock::time_point start, Clock::time_point end) {
+	return std::chrono::duration<double>(end - start).count();
+}
+
+// Add two vectors of len elements in buffers from the pool, or new ones if
+// pool is null, and give the buffers back
+void step(OCHEnvironment &env, OCHBufferPool *pool, const std::vector<int> &A,
+	const std::vector<int> &B, std::vector<int> &C, int len)
+{
+	cl::CommandQueue &queue = env.queue(0);
+	size_t bsize = len * sizeof(int);
+	cl::Buffer inA, inB, outC;
+	if (pool) {
+		inA = pool->acquire(OCH_MEM_FLAGS("r"), bsize);
+		inB = pool->acquire(OCH_MEM_FLAGS("r"), bsize);
+		outC = pool->acquire(OCH_MEM_FLAGS("w"), bsize);
+	} else {
+		inA = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+		inB = create_buffer(env.context, OCH_MEM_FLAGS("r"), bsize);
+		outC = create_buffer(env.context, OCH_MEM_FLAGS("w"), bsize);
+	}
+	std::vector<cl::Event> uploads;
+	uploads.push_back(enqueue_write_buffer(queue, inA, 0, bsize, &A[0]));
+	uploads.push_back(enqueue_write_buffer(queue, inB, 0, bsize, &B[0]));
+	cl::Kernel &kern = env.kernel("vector_add");
+	set_kernel_args(kern, inA, inB, outC, len);
+	// The queue is in order, so the read follows the kernel
+	enqueue_nd_range_kernel(queue, kern, cl::NullRange, cl::NDRange(len),
+		cl::NullRange, uploads);
+	blocking_read_buffer(queue, outC, 0, bsize, &C[0]);
+	if (pool) {
+		pool->release(inA);
+		pool->release(inB);
+		pool->release(outC);
+	}
+}
+
+int main(int argc, char **argv) {
+	int iterations = argc > 1 ? std::atoi(argv[1]) : 10000;
+	const int max_len = 1 << 16;
+	const int warm_up = 100;
+
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+	env.load_program("vector_add_kernel.cl");
+	std::vector<int> A(max_len, 1), B(max_len, 2), C(max_len);
+
+	// Sizes vary, so that steps fall in different size classes
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < iterations; ++i)
+		step(env, 0, A, B, C, max_len >> (i % 8));
+	double plain = seconds(start, Clock::now());
+	bool ok = C[0] == 3;
+
+	OCHBufferPool pool(env.context);
+	for (int i = 0; i < warm_up; ++i)
+		step(env, &pool, A, B, C, max_len >> (i % 8));
+	size_t warm_created = pool.created;
+	start = Clock::now();
+	for (int i = 0; i < iterations; ++i)
+		step(env, &pool, A, B, C, max_len >> (i % 8));
+	double pooled = seconds(start, Clock::now());
+	ok = ok && C[0] == 3;
+
+	std::cout << "create_buffer: " << plain / iterations * 1e6
+		<< " us per step, " << 3 * iterations << " buffers created"
+		<< std::endl;
+	std::cout << "pool: " << pooled / iterations * 1e6 << " us per step, "
+		<< warm_created << " buffers created in warm-up, "
+		<< pool.created - warm_created << " after, " << pool.reused
+		<< " reused, " << pool.high_water << " bytes at most" << std::endl;
+	std::cout << "check: " << (ok ? "ok" : "FAILED") << std::endl;
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,81 @@
+// Least significant digit radix sort of integer keys, with optional values.
+// Each pass sorts by a digit of RADIX_BITS bits: radix_count counts the
+// digits in the chunk of each work-item, the counts are scanned (see scan.cl)
+// in digit-major order, giving each work-item where its elements of each
+// digit go, and radix_scatter moves them there in order, so passes are
+// stable. Every pass must run with the same global size. Build defines:
+//  K           key type (uint)
+//  V           value type (uint)
+//  FLIP        mask xor-ed to keys to sort them as unsigned, the sign bit
+//              for signed keys (0)
+//  RADIX_BITS  bits of the digits (8)
+
+#ifndef K
+#define K uint
+#endif
+#ifndef V
+#define V uint
+#endif
+#ifndef FLIP
+#define FLIP 0
+#endif
+#ifndef RADIX_BITS
+#define RADIX_BITS 8
+#endif
+
+#define RADIX (1 << RADIX_BITS)
+#define DIGIT(key, shift) ((uint)((((key) ^ FLIP) >> (shift)) & (RADIX - 1)))
+
+// Elements [begin, end) of the n, handled by the work-item
+void chunk_bounds(ulong n, size_t *begin, size_t *end) {
+	size_t items = get_global_size(0);
+	size_t chunk = (n + items - 1) / items;
+	*begin = min((size_t)(get_global_id(0) * chunk), (size_t)n);
+	*end = min((size_t)(*begin + chunk), (size_t)n);
+}
+
+// Count the digits at shift of the keys of the work-item chunk, into
+// counts[digit * work-items + work-item]
+__kernel void radix_count(__global const K *keys, __global uint *counts, const ulong n, const uint shift) {
+	uint count[RADIX];
+	for (int d = 0; d < RADIX; ++d)
+		count[d] = 0;
+	size_t begin, end;
+	chunk_bounds(n, &begin, &end);
+	for (size_t i = begin; i < end; ++i)
+		count[DIGIT(keys[i], shift)]++;
+	size_t items = get_global_size(0);
+	for (int d = 0; d < RADIX; ++d)
+		counts[d * items + get_global_id(0)] = count[d];
+}
+
+// Move the keys of the work-item chunk to the positions given by the
+// exclusive scan of the counts
+__kernel void radix_scatter(__global const K *keys, __global K *out, __global const uint *offsets, const ulong n, const uint shift) {
+	uint offset[RADIX];
+	size_t items = get_global_size(0);
+	for (int d = 0; d < RADIX; ++d)
+		offset[d] = offsets[d * items + get_global_id(0)];
+	size_t begin, end;
+	chunk_bounds(n, &begin, &end);
+	for (size_t i = begin; i < end; ++i) {
+		K key = keys[i];
+		out[offset[DIGIT(key, shift)]++] = key;
+	}
+}
+
+// Same as radix_scatter, moving the values along their keys
+__kernel void radix_scatter_pairs(__global const K *keys, __global K *out, __global const V *values, __global V *out_values, __global const uint *offsets, const ulong n, const uint shift) {
+	uint offset[RADIX];
+	size_t items = get_global_size(0);
+	for (int d = 0; d < RADIX; ++d)
+		offset[d] = offsets[d * items + get_global_id(0)];
+	size_t begin, end;
+	chunk_bounds(n, &begin, &end);
+	for (size_t i = begin; i < end; ++i) {
+		K key = keys[i];
+		uint pos = offset[DIGIT(key, shift)]++;
+		out[pos] = key;
+		out_values[pos] = values[i];
+	}
+}
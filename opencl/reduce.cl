@@ -0,0 +1,92 @@
+// Reductions of arrays, in two passes: each work-group reduces a part of the
+// input to one partial result, then a single work-group reduces the partial
+// results. Element type and operation come from build defines:
+//  T         element type (int)
+//  OP(a, b)  associative operation (a + b)
+//  IDENTITY  identity element of OP (0)
+//  BETTER(a, b) whether a wins over b in reduce_arg (a > b, so argmax)
+//  WG_SIZE   local size the kernels are run with, a power of two (256)
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef T
+#define T int
+#endif
+#ifndef OP
+#define OP(a, b) ((a) + (b))
+#endif
+#ifndef IDENTITY
+#define IDENTITY 0
+#endif
+#ifndef BETTER
+#define BETTER(a, b) ((a) > (b))
+#endif
+#ifndef WG_SIZE
+#define WG_SIZE 256
+#endif
+
+// Reduce the n elements of in, writing the result of each work-group in
+// out[group]. Work-items stride over the input, so any number of groups can
+// be used; run again with one group on the partial results to finish
+__kernel void reduce(__global const T *in, __global T *out, const ulong n) {
+	__local T scratch[WG_SIZE];
+	size_t lid = get_local_id(0);
+
+	T acc = IDENTITY;
+	for (size_t i = get_global_id(0); i < n; i += get_global_size(0))
+		acc = OP(acc, in[i]);
+	scratch[lid] = acc;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (size_t s = WG_SIZE / 2; s > 0; s >>= 1) {
+		if (lid < s)
+			scratch[lid] = OP(scratch[lid], scratch[lid + s]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0)
+		out[get_group_id(0)] = scratch[0];
+}
+
+// Missing index, of work-items without values
+#define NO_INDEX ((ulong)-1)
+
+// Whether the pair (b, ib) replaces (a, ia) as the best one
+#define REPLACES(a, ia, b, ib) ((ib) != NO_INDEX && ((ia) == NO_INDEX || \
+	BETTER(b, a) || (!BETTER(a, b) && (ib) < (ia))))
+
+// Find the value not beaten by any other, the first one among equals, as
+// reduce, writing a value and its index for each work-group. Indices are
+// positions in values when first is not zero, else they are read from
+// indices, to run again on the partial results
+__kernel void reduce_arg(__global const T *values, __global const ulong *indices, __global T *out_values, __global ulong *out_indices, const ulong n, const int first) {
+	__local T scratch[WG_SIZE];
+	__local ulong scratch_index[WG_SIZE];
+	size_t lid = get_local_id(0);
+
+	T best = IDENTITY;
+	ulong best_index = NO_INDEX;
+	for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) {
+		ulong index = first ? i : indices[i];
+		if (REPLACES(best, best_index, values[i], index)) {
+			best = values[i];
+			best_index = index;
+		}
+	}
+	scratch[lid] = best;
+	scratch_index[lid] = best_index;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (size_t s = WG_SIZE / 2; s > 0; s >>= 1) {
+		if (lid < s && REPLACES(scratch[lid], scratch_index[lid],
+			scratch[lid + s], scratch_index[lid + s]))
+		{
+			scratch[lid] = scratch[lid + s];
+			scratch_index[lid] = scratch_index[lid + s];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0) {
+		out_values[get_group_id(0)] = scratch[0];
+		out_indices[get_group_id(0)] = scratch_index[0];
+	}
+}
@@ -0,0 +1,46 @@
+// Compiled with
+// g++ -std=c++11 -O2 reduce_ochell.cpp -o reduce_ochell -l OpenCL && ./reduce_ochell
+// Usage: ./reduce_ochell [length (16777216)]
+// Sum, minimum, maximum and argmax of int and float arrays on the device,
+// checked against the host
+
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
+
+#include "ochell.hh"
+
+template <typename T>
+bool check(OCHEnvironment &env, const std::vector<T> &host) {
+	DeviceVector<T> vec(env.context, host.size());
+	vec.copy_from(env.queue(), &host[0]).wait();
+	T sum = reduce_sum(env, vec), lo = reduce_min(env, vec);
+	T hi = reduce_max(env, vec);
+	size_t arg = reduce_argmax(env, vec);
+	std::cout << OCHTypeName<T>::name() << ": sum " << sum << ", min " << lo
+		<< ", max " << hi << " at " << arg << std::endl;
+
+	T host_sum = 0;
+	for (size_t i = 0; i < host.size(); ++i)
+		host_sum += host[i];
+	size_t host_arg = std::max_element(host.begin(), host.end()) - host.begin();
+	return sum == host_sum && arg == host_arg && hi == host[host_arg] &&
+		lo == *std::min_element(host.begin(), host.end());
+}
+
+int main(int argc, char **argv) {
+	size_t len = argc > 1 ? std::atol(argv[1]) : 1 << 24;
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+
+	std::vector<cl_int> ints(len);
+	// Small values, so sums are exact in floats too
+	std::vector<cl_float> floats(len);
+	for (size_t i = 0; i < len; ++i) {
+		ints[i] = std::rand() % 2001 - 1000;
+		floats[i] = (float)(std::rand() % 9 - 4);
+	}
+	bool ok = check(env, ints) && check(env, floats);
+	std::cout << "check: " << (ok ? "ok" : "FAILED") << std::endl;
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,81 @@
+// Prefix sums of arrays, in levels: scan_blocks scans blocks of the input and
+// writes the total of each block, the totals are scanned the same way, and
+// scan_add adds the scanned totals to the blocks. Build defines:
+//  T        element type (int)
+//  WG_SIZE  local size the kernels are run with, a power of two (256)
+//  ITEMS    consecutive elements scanned by each work-item (8)
+// Blocks are WG_SIZE * ITEMS elements, and each work-group handles one
+
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+#ifndef T
+#define T int
+#endif
+#ifndef WG_SIZE
+#define WG_SIZE 256
+#endif
+#ifndef ITEMS
+#define ITEMS 8
+#endif
+
+#define BLOCK (WG_SIZE * ITEMS)
+
+// Scan the n elements of in into out, which may be the same buffer, within
+// each block, inclusive or exclusive, and write the total of each block in
+// sums[group]. Each work-item scans its elements sequentially, then the
+// work-item totals are scanned in local memory with up and down sweeps
+__kernel void scan_blocks(__global const T *in, __global T *out, __global T *sums, const ulong n, const int inclusive) {
+	__local T scratch[WG_SIZE];
+	size_t lid = get_local_id(0);
+	size_t base = get_group_id(0) * BLOCK + lid * ITEMS;
+
+	T items[ITEMS];
+	T total = 0;
+	for (int k = 0; k < ITEMS; ++k) {
+		T value = base + k < n ? in[base + k] : 0;
+		items[k] = inclusive ? total + value : total;
+		total += value;
+	}
+	scratch[lid] = total;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// Up sweep: each node gets the sum of its subtree
+	for (size_t d = 1; d < WG_SIZE; d <<= 1) {
+		size_t i = (lid + 1) * 2 * d - 1;
+		if (i < WG_SIZE)
+			scratch[i] += scratch[i - d];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == WG_SIZE - 1) {
+		sums[get_group_id(0)] = scratch[lid];
+		scratch[lid] = 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	// Down sweep: each node gets the sum of the nodes before it
+	for (size_t d = WG_SIZE / 2; d > 0; d >>= 1) {
+		size_t i = (lid + 1) * 2 * d - 1;
+		if (i < WG_SIZE) {
+			T left = scratch[i - d];
+			scratch[i - d] = scratch[i];
+			scratch[i] += left;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	T offset = scratch[lid];
+	for (int k = 0; k < ITEMS; ++k)
+		if (base + k < n)
+			out[base + k] = offset + items[k];
+}
+
+// Add offsets[group] to the elements of each block of the n in out. Run with
+// the same sizes as scan_blocks
+__kernel void scan_add(__global T *out, __global const T *offsets, const ulong n) {
+	T offset = offsets[get_group_id(0)];
+	size_t base = get_group_id(0) * BLOCK + get_local_id(0) * ITEMS;
+	for (int k = 0; k < ITEMS; ++k)
+		if (base + k < n)
+			out[base + k] += offset;
+}
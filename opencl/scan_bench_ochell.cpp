@@ -0,0 +1,62 @@
+// Compiled with
+// g++ -std=c++17 -O2 scan_bench_ochell.cpp -o scan_bench_ochell -l OpenCL -l tbb && ./scan_bench_ochell
+// Usage: ./scan_bench_ochell [length (100000000)]
+// Inclusive scan of int, float and long arrays on the device, with data
+// resident and with transfers, against std::inclusive_scan with the
+// parallel execution policy
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <numeric>
+#include <execution>
+
+#include "ochell.hh"
+
+typedef std::chrono::steady_clock Clock;
+
+double ms_since(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count() * 1e3;
+}
+
+template <typename T>
+void bench(OCHEnvironment &env, size_t len) {
+	// Sums are 0 or 1, so they are exact in floats too
+	std::vector<T> host(len), expected(len), result(len);
+	for (size_t i = 0; i < len; ++i)
+		host[i] = (T)(i % 2 == 0 ? 1 : -1);
+
+	Clock::time_point start = Clock::now();
+	std::inclusive_scan(std::execution::par, host.begin(), host.end(),
+		expected.begin());
+	double host_ms = ms_since(start);
+
+	DeviceVector<T> in(env.context, len), out(env.context, len);
+	in.copy_from(env.queue(), &host[0]).wait();
+	// Once to build the kernels
+	inclusive_scan(env, in, out).wait();
+	start = Clock::now();
+	inclusive_scan(env, in, out).wait();
+	double device_ms = ms_since(start);
+
+	start = Clock::now();
+	in.copy_from(env.queue(), &host[0]);
+	inclusive_scan(env, in, out);
+	out.copy_to(env.queue(), &result[0]).wait();
+	double transfer_ms = ms_since(start);
+
+	std::cout << OCHTypeName<T>::name() << ": std::inclusive_scan(par) "
+		<< host_ms << " ms, device " << device_ms << " ms, with transfers "
+		<< transfer_ms << " ms, "
+		<< (result == expected ? "ok" : "FAILED") << std::endl;
+}
+
+int main(int argc, char **argv) {
+	size_t len = argc > 1 ? std::atol(argv[1]) : 100000000;
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+	bench<cl_int>(env, len);
+	bench<cl_float>(env, len);
+	bench<cl_long>(env, len);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,67 @@
+// Compiled with
+// g++ -std=c++11 -O2 sort_bench_ochell.cpp -o sort_bench_ochell -l OpenCL && ./sort_bench_ochell
+// Usage: ./sort_bench_ochell [length (100000000)]
+// Radix sort of random 32 bit keys, alone and with values, on the device
+// against std::sort on one host thread
+
+#include <iostream>
+#include <cstdlib>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include "ochell.hh"
+
+typedef std::chrono::steady_clock Clock;
+
+double ms_since(Clock::time_point start) {
+	return std::chrono::duration<double>(Clock::now() - start).count() * 1e3;
+}
+
+int main(int argc, char **argv) {
+	size_t len = argc > 1 ? std::atol(argv[1]) : 100000000;
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+
+	std::vector<cl_uint> keys(len), values(len), result(len);
+	std::mt19937 rng(42);
+	for (size_t i = 0; i < len; ++i) {
+		keys[i] = rng();
+		values[i] = i;
+	}
+
+	std::vector<cl_uint> expected = keys;
+	Clock::time_point start = Clock::now();
+	std::sort(expected.begin(), expected.end());
+	std::cout << "std::sort: " << ms_since(start) << " ms" << std::endl;
+
+	DeviceVector<cl_uint> dkeys(env.context, len), dvalues(env.context, len);
+	// Once to build the kernels
+	dkeys.copy_from(env.queue(), &keys[0]);
+	sort(env, dkeys).wait();
+
+	dkeys.copy_from(env.queue(), &keys[0]).wait();
+	start = Clock::now();
+	sort(env, dkeys).wait();
+	double sort_ms = ms_since(start);
+	dkeys.copy_to(env.queue(), &result[0]).wait();
+	std::cout << "keys: " << sort_ms << " ms, "
+		<< (result == expected ? "ok" : "FAILED") << std::endl;
+
+	dkeys.copy_from(env.queue(), &keys[0]);
+	dvalues.copy_from(env.queue(), &values[0]).wait();
+	start = Clock::now();
+	sort(env, dkeys, dvalues).wait();
+	sort_ms = ms_since(start);
+	std::vector<cl_uint> sorted_values(len);
+	dkeys.copy_to(env.queue(), &result[0]);
+	dvalues.copy_to(env.queue(), &sorted_values[0]).wait();
+	// Values must still be paired with their keys, in input order among equals
+	bool ok = result == expected;
+	for (size_t i = 0; i < len && ok; ++i)
+		ok = keys[sorted_values[i]] == result[i] && (i == 0 ||
+			result[i] != result[i - 1] || sorted_values[i] > sorted_values[i - 1]);
+	std::cout << "keys and values: " << sort_ms << " ms, "
+		<< (ok ? "ok" : "FAILED") << std::endl;
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,45 @@
+// Compiled with
+// g++ -std=c++11 -O2 stream_ochell.cpp -o stream_ochell -l OpenCL && ./stream_ochell
+// Usage: ./stream_ochell [length in Mi elements (64)] [chunk in Mi elements (4)]
+// Streams vector_add over host arrays through the first device, with one set
+// of buffers (no overlap) and with two and three sets
+
+#include <iostream>
+#include <cstdlib>
+
+#include "ochell.hh"
+
+int main(int argc, char **argv) {
+	size_t len = (size_t)(argc > 1 ? std::atol(argv[1]) : 64) << 20;
+	size_t chunk = (size_t)(argc > 2 ? std::atol(argv[2]) : 4) << 20;
+	size_t bsize = len * sizeof(cl_int);
+
+	OCHEnvironment env(CL_DEVICE_TYPE_ALL);
+	env.load_program("vector_add_kernel.cl");
+	cl_int *A = (cl_int *)aligned_host_alloc(env.context, bsize);
+	cl_int *B = (cl_int *)aligned_host_alloc(env.context, bsize);
+	cl_int *C = (cl_int *)aligned_host_alloc(env.context, bsize);
+	for (size_t i = 0; i < len; ++i) {
+		A[i] = i;
+		B[i] = 2 * i;
+	}
+
+	for (size_t depth = 1; depth <= 3; ++depth) {
+		OCHStream stream(env.context, env.devices[0], chunk, depth);
+		// Once to allocate the buffers and warm up
+		stream_vector_add(env, stream, A, B, C, len);
+		stream_vector_add(env, stream, A, B, C, len);
+		std::cout << depth << " buffer sets: ";
+		stream.print(std::cout);
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < len && ok; ++i)
+		ok = C[i] == (cl_int)(3 * i);
+	std::cout << "check: " << (ok ? "ok" : "FAILED") << std::endl;
+
+	aligned_host_free(A);
+	aligned_host_free(B);
+	aligned_host_free(C);
+	exit(EXIT_SUCCESS);
+}
@@ -1,6 +1,29 @@
+#ifndef ELEMS_PER_ITEM
+#define ELEMS_PER_ITEM 4
+#endif
+
 __kernel void vector_add(__global const int *A, __global const int *B, __global int *C, const int len) {
 	int tid = get_global_id(0);
 	if (tid < len)
 		C[tid] = A[tid] + B[tid];
 }
 
+// vector_addN adds ELEMS_PER_ITEM consecutive intN vectors for each work-item,
+// so it is run with ceil(len / (N * ELEMS_PER_ITEM)) work-items. The range
+// checks are per vector, and the work-item reaching the end of the arrays
+// adds the last len % N elements one by one
+#define VECTOR_ADD(N) \
+__kernel void vector_add##N(__global const int *A, __global const int *B, __global int *C, const int len) { \
+	int first = get_global_id(0) * ELEMS_PER_ITEM; \
+	int full = len / N; \
+	int last = min(first + ELEMS_PER_ITEM, full); \
+	for (int i = first; i < last; ++i) \
+		vstore##N(vload##N(i, A) + vload##N(i, B), i, C); \
+	if (first <= full && full < first + ELEMS_PER_ITEM) \
+		for (int i = full * N; i < len; ++i) \
+			C[i] = A[i] + B[i]; \
+}
+
+VECTOR_ADD(4)
+VECTOR_ADD(8)
+VECTOR_ADD(16)